@@ -49,28 +49,55 @@ void
 bzero(void *vblock, size_t len)
 {
 	char *block = vblock;
-	size_t i;
+	long *lb;
 
 	/*
-	 * For performance, optimize the common case where the pointer
-	 * and the length are word-aligned, and write word-at-a-time
-	 * instead of byte-at-a-time. Otherwise, write bytes.
+	 * For performance, write bytes up to the first word boundary,
+	 * then words eight at a time, then the leftover words and
+	 * bytes. Any pointer can be lined up this way, so only the
+	 * head and tail ever go byte-at-a-time. Blocks shorter than two
+	 * words that aren't aligned to begin with are left to the byte
+	 * loop at the end; lining them up costs more than it saves.
 	 *
 	 * The alignment logic here should be portable. We rely on the
 	 * compiler to be reasonably intelligent about optimizing the
 	 * divides and moduli out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)block % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-		long *lb = (long *)block;
-		for (i=0; i<len/sizeof(long); i++) {
-			lb[i] = 0;
+	if (len < 2*sizeof(long) && (uintptr_t)block % sizeof(long) != 0) {
+		while (len > 0) {
+			*block++ = 0;
+			len--;
 		}
+		return;
 	}
-	else {
-		for (i=0; i<len; i++) {
-			block[i] = 0;
-		}
+
+	while ((uintptr_t)block % sizeof(long) != 0) {
+		*block++ = 0;
+		len--;
+	}
+
+	lb = (long *)block;
+	while (len >= 8*sizeof(long)) {
+		lb[0] = 0;
+		lb[1] = 0;
+		lb[2] = 0;
+		lb[3] = 0;
+		lb[4] = 0;
+		lb[5] = 0;
+		lb[6] = 0;
+		lb[7] = 0;
+		lb += 8;
+		len -= 8*sizeof(long);
+	}
+	while (len >= sizeof(long)) {
+		*lb++ = 0;
+		len -= sizeof(long);
+	}
+
+	block = (char *)lb;
+	while (len > 0) {
+		*block++ = 0;
+		len--;
 	}
 }
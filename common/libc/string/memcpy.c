@@ -40,6 +40,18 @@
 #include <string.h>
 #endif
 
+/*
+ * MERGE(w0, w1, n) is the word that starts n bytes into w0 and runs on
+ * into w1; which way to shift depends on the byte order.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MERGE(w0, w1, n) \
+	(((w0) << (8 * (n))) | ((w1) >> (8 * (sizeof(long) - (n)))))
+#else
+#define MERGE(w0, w1, n) \
+	(((w0) >> (8 * (n))) | ((w1) << (8 * (sizeof(long) - (n)))))
+#endif
+
 /*
  * C standard function - copy a block of memory.
  */
@@ -47,39 +59,97 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * Copies shorter than two words go straight to the byte loop at
+	 * the bottom; setting up the word loops costs more than it saves
+	 * for them, even when both pointers are aligned already.
+	 *
+	 * Otherwise copy bytes up to the first word boundary of DST. If
+	 * SRC is then aligned too, copy words four at a time, then the
+	 * leftover words and bytes. All four loads are issued before the
+	 * stores so they can overlap in the pipeline. If SRC isn't
+	 * aligned (and misaligned word accesses trap), load aligned words
+	 * from it and shift each neighbouring pair together into the
+	 * word to store. Each load has at least one byte we want in it,
+	 * so nothing outside SRC's first and last words is touched.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= 2*sizeof(long)) {
+		unsigned long *ld;
+		const unsigned long *ls;
+		unsigned long w0, w1, w2, w3;
+		unsigned lead;
 
-		long *d = dst;
-		const long *s = src;
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		ld = (unsigned long *)d;
+		lead = (uintptr_t)s % sizeof(long);
+		ls = (const unsigned long *)(s - lead);
+		if (lead != 0) {
+			w0 = *ls++;
+			while (len >= 2*sizeof(long)) {
+				w1 = ls[0];
+				w2 = ls[1];
+				ld[0] = MERGE(w0, w1, lead);
+				ld[1] = MERGE(w1, w2, lead);
+				w0 = w2;
+				ld += 2;
+				ls += 2;
+				len -= 2*sizeof(long);
+			}
+			if (len >= sizeof(long)) {
+				w1 = *ls++;
+				*ld++ = MERGE(w0, w1, lead);
+				len -= sizeof(long);
+			}
+			ls--;
+		}
+		while (len >= 4*sizeof(long)) {
+			w0 = ls[0];
+			w1 = ls[1];
+			w2 = ls[2];
+			w3 = ls[3];
+			ld[0] = w0;
+			ld[1] = w1;
+			ld[2] = w2;
+			ld[3] = w3;
+			ld += 4;
+			ls += 4;
+			len -= 4*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*ld++ = *ls++;
+			len -= sizeof(long);
 		}
+		d = (char *)ld;
+		s = (const char *)ls + lead;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len >= 4) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+		d[3] = s[3];
+		d += 4;
+		s += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
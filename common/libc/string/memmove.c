@@ -40,6 +40,18 @@
 #include <string.h>
 #endif
 
+/*
+ * MERGE(w0, w1, n): the word that starts n bytes into w0 and runs on
+ * into w1. See memcpy.c.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MERGE(w0, w1, n) \
+	(((w0) << (8 * (n))) | ((w1) >> (8 * (sizeof(long) - (n)))))
+#else
+#define MERGE(w0, w1, n) \
+	(((w0) >> (8 * (n))) | ((w1) << (8 * (sizeof(long) - (n)))))
+#endif
+
 /*
  * C standard function - copy a block of memory, handling overlapping
  * regions correctly.
@@ -48,7 +60,8 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +97,82 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * This is memcpy's loop run from the top end down; look in
+	 * memcpy.c for more information. Within each group of words, all
+	 * the loads happen before any store. With DST above SRC and DST
+	 * aligned, every word stored is at or above the aligned word
+	 * being loaded, so the overlap doesn't bite.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= 2*sizeof(long)) {
+		unsigned long *ld;
+		const unsigned long *ls;
+		unsigned long w0, w1, w2, w3;
+		unsigned lead;
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		ld = (unsigned long *)d;
+		lead = (uintptr_t)s % sizeof(long);
+		ls = (const unsigned long *)(s - lead);
+		if (lead != 0) {
+			/* w1 is the word S ends in, and we work down */
+			w1 = *ls;
+			while (len >= 2*sizeof(long)) {
+				w0 = ls[-1];
+				w2 = ls[-2];
+				ld[-1] = MERGE(w0, w1, lead);
+				ld[-2] = MERGE(w2, w0, lead);
+				w1 = w2;
+				ld -= 2;
+				ls -= 2;
+				len -= 2*sizeof(long);
+			}
+			if (len >= sizeof(long)) {
+				w0 = *--ls;
+				*--ld = MERGE(w0, w1, lead);
+				len -= sizeof(long);
+			}
+		}
+		while (len >= 4*sizeof(long)) {
+			ld -= 4;
+			ls -= 4;
+			w3 = ls[3];
+			w2 = ls[2];
+			w1 = ls[1];
+			w0 = ls[0];
+			ld[3] = w3;
+			ld[2] = w2;
+			ld[1] = w1;
+			ld[0] = w0;
+			len -= 4*sizeof(long);
 		}
+		while (len >= sizeof(long)) {
+			*--ld = *--ls;
+			len -= sizeof(long);
+		}
+		d = (char *)ld;
+		s = (const char *)ls + lead;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len >= 4) {
+		d -= 4;
+		s -= 4;
+		d[3] = s[3];
+		d[2] = s[2];
+		d[1] = s[1];
+		d[0] = s[0];
+		len -= 4;
+	}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
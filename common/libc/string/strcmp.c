@@ -36,9 +36,28 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+/*
+ * HASZERO(w) is nonzero if any byte of the word w is zero, and LEAD(n)
+ * is all ones in the bytes before byte n. See strlen.c. MERGE(w0, w1,
+ * n) is the word that starts n bytes into w0 and runs on into w1.
+ */
+#define ONES		((unsigned long)-1 / 0xff)
+#define HIGHS		(ONES * 0x80)
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LEAD(n)		((n) == 0 ? 0 : ~0UL << (8 * (sizeof(long) - (n))))
+#define MERGE(w0, w1, n) \
+	(((w0) << (8 * (n))) | ((w1) >> (8 * (sizeof(long) - (n)))))
+#else
+#define LEAD(n)		((1UL << (8 * (n))) - 1)
+#define MERGE(w0, w1, n) \
+	(((w0) >> (8 * (n))) | ((w1) << (8 * (sizeof(long) - (n)))))
+#endif
+
 /*
  * Standard C string function: compare two strings and return their
  * sort order.
@@ -49,6 +68,73 @@ strcmp(const char *a, const char *b)
 {
 	size_t i;
 
+	/*
+	 * Most strings compared differ or end within their first few
+	 * bytes, so first check up to two words' worth a byte at a time,
+	 * before doing anything about alignment. Past that, skip ahead
+	 * over matching bytes until A is on a word boundary, then over
+	 * matching words that contain no terminator. That
+	 * leaves A and B in the word where they differ or end, and the
+	 * byte loop below finds the spot.
+	 *
+	 * If B is then at a different offset within its word, each word
+	 * of B is put together from two aligned words with MERGE. The
+	 * second of those is only loaded once the first has been seen to
+	 * have no terminator in the part that belongs to B; so, as when
+	 * both are aligned, neither string is read past the aligned word
+	 * holding its end.
+	 */
+
+	for (i=0; a[i]!=0 && a[i]==b[i]; i++) {
+		if (i == 2*sizeof(long) - 1) {
+			goto aligning;
+		}
+	}
+	goto done;
+ aligning:
+	a += 2*sizeof(long);
+	b += 2*sizeof(long);
+
+	while ((uintptr_t)a % sizeof(long) != 0 && *a != 0 && *a == *b) {
+		a++;
+		b++;
+	}
+
+	if ((uintptr_t)a % sizeof(long) == 0) {
+		const unsigned long *wa, *wb;
+		unsigned long b0, b1, m;
+		unsigned lead = (uintptr_t)b % sizeof(long);
+
+		wa = (const unsigned long *)a;
+		wb = (const unsigned long *)(b - lead);
+		if (lead == 0) {
+			while (*wa == *wb && !HASZERO(*wa)) {
+				wa++;
+				wb++;
+			}
+		}
+		else {
+			b0 = *wb;
+			if (!HASZERO(b0 | LEAD(lead))) {
+				for (;;) {
+					b1 = wb[1];
+					m = MERGE(b0, b1, lead);
+					if (*wa != m || HASZERO(m)) {
+						break;
+					}
+					wa++;
+					wb++;
+					if (HASZERO(b1)) {
+						break;
+					}
+					b0 = b1;
+				}
+			}
+		}
+		a = (const char *)wa;
+		b = (const char *)wb + lead;
+	}
+
 	/*
 	 * Walk down both strings until either they're different
 	 * or we hit the end of A.
@@ -67,6 +153,7 @@ strcmp(const char *a, const char *b)
 		/* nothing */
 	}
 
+ done:
 	/*
 	 * If A is greater than B, return 1. If A is less than B,
 	 * return -1.  If they're the same, return 0. Since we have
@@ -36,9 +36,30 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+/*
+ * HASZERO(w) is nonzero if any byte of the word w is zero: subtracting
+ * 1 from each byte borrows into the high bit only for bytes that were
+ * zero (or already had the high bit set, which ~w screens out).
+ */
+#define ONES		((unsigned long)-1 / 0xff)
+#define HIGHS		(ONES * 0x80)
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+
+/*
+ * LEAD(n) has all ones in the bytes of a word that come before byte n
+ * in memory; ORing it in makes them nonzero. Which end of the word
+ * those are depends on the byte order, which the compiler tells us.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LEAD(n)		((n) == 0 ? 0 : ~0UL << (8 * (sizeof(long) - (n))))
+#else
+#define LEAD(n)		((1UL << (8 * (n))) - 1)
+#endif
+
 /*
  * C standard string function: get length of a string
  */
@@ -46,10 +67,33 @@
 size_t
 strlen(const char *str)
 {
-	size_t ret = 0;
+	const char *p;
+	const unsigned long *w;
+	unsigned long v;
+	unsigned lead = (uintptr_t)str % sizeof(long);
+
+	/*
+	 * Go a word at a time from the aligned word STR is in, until a
+	 * word with a zero byte in it, then find which byte. The bytes
+	 * of the first word ahead of STR are forced nonzero, so a short
+	 * or misaligned string costs one or two word loads rather than
+	 * a byte loop up to the boundary and another after it. Reading
+	 * a whole aligned word may look outside the string, but never
+	 * off the page it's on, so it can't fault.
+	 */
 
-	while (str[ret]) {
-		ret++;
+	w = (const unsigned long *)(str - lead);
+	v = *w | LEAD(lead);
+	while (!HASZERO(v)) {
+		v = *++w;
+	}
+
+	p = (const char *)w;
+	if (p < str) {
+		p = str;
+	}
+	while (*p) {
+		p++;
 	}
-	return ret;
+	return p - str;
 }
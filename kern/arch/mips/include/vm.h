@@ -37,10 +37,33 @@ typedef uint8_t page_state_t;
 #define PAGE_DIRTY 2
 #define PAGE_FIXED 3
 
+/*
+ * Page table entry, packed into one word:
+ *   bits 0-14   coremap index, while VPAGE_INMEMORY
+ *   bits 15-28  swap slot, while VPAGE_INSWAP
+ *   bits 29-31  status
+ * A zero entry (VPAGE_UNINIT) is a page nobody has touched yet;
+ * whether it may be touched at all is up to the region it is in.
+ * VPAGE_ZEROFILL is the one other entry with no status bits: nobody
+ * has written the page, but TLBs may map it to the zero page.
+ */
+typedef uint32_t pte_t;
+
 #define VPAGE_UNINIT 0
-#define VPAGE_INMEMORY 1
-#define VPAGE_INSWAP 2
-#define VPAGE_BUSY 4
+#define VPAGE_INMEMORY 0x20000000
+#define VPAGE_INSWAP 0x40000000
+#define VPAGE_BUSY 0x80000000	/* being evicted or cleaned, hands off until it clears */
+#define VPAGE_ZEROFILL PTE_SLOTMASK	/* untouched, but read through the shared zero page */
+
+#define PTE_FRAMEMASK 0x00007fff
+#define PTE_SLOTMASK 0x1fff8000
+#define PTE_SLOTSHIFT 15
+#define PTE_MAXFRAMES (PTE_FRAMEMASK + 1)	/* 128M of RAM */
+
+#define PTE_FRAME(pte) ((index_t)((pte) & PTE_FRAMEMASK))
+#define PTE_SLOT(pte) ((index_t)(((pte) & PTE_SLOTMASK) >> PTE_SLOTSHIFT))
+#define PTE_SETFRAME(pte, index) ((pte) = ((pte) & ~PTE_FRAMEMASK) | (index))
+#define PTE_SETSLOT(pte, slot) ((pte) = ((pte) & ~PTE_SLOTMASK) | ((pte_t)(slot) << PTE_SLOTSHIFT))
 /*
  * Machine-dependent VM system definitions.
  */
@@ -135,6 +158,12 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 typedef uint16_t index_t;
 
+/* "no frame" marker for the coremap free lists */
+#define COREMAP_NONE ((index_t)0xFFFF)
+
+/* largest buddy block is 2^COREMAP_MAXORDER frames (4M) */
+#define COREMAP_MAXORDER 10
+
 struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
@@ -146,29 +175,94 @@ struct tlbshootdown {
 
 #define TLBSHOOTDOWN_MAX 16
 
+struct vnode;
+
 paddr_t allocate_onepage(void);
 paddr_t allocate_multiplepages(int npages);
-int allocate_userpage(struct addrspace*, int, int, index_t*);
-void free_userpage(index_t index);
+int allocate_userpage(struct addrspace*, int, int, bool zero, index_t*);
+void free_userpage(index_t index, struct addrspace *as);
+int share_userpage(index_t index, struct addrspace *as, vaddr_t vaddr);
+bool pin_userpage(pte_t *pte);
+void unpin_userpage(index_t index);
+void free_virtualpage(struct addrspace *as, int uberindex, int subindex);
+bool isevictable(index_t index);
+int copyonwrite(struct addrspace *as, int uberindex, int subindex);
 void copy_page(index_t dst, index_t src);
 void* memset(void *ptr, int ch, size_t len);
+void page_zero(vaddr_t kva);
+void page_copy(vaddr_t dst, vaddr_t src);
 
-int swapin(struct addrspace *as, int uberindex, int subindex);
+int swapin(struct addrspace *as, int uberindex, int subindex, unsigned window);
 int swapout(index_t *coremapindex, bool allocate, struct addrspace *as);
 int readfromswap(index_t coremapindex, index_t swapoffset);
 int writetoswap(index_t coremapindex, index_t *swapoffset);
 void evict(index_t coremapindex);
-index_t findfreeswapoffset(void);
+index_t findfreeswapoffset(struct addrspace *as);
+void swapfree(index_t swapoffset);
 int chooseframetoevict(index_t*);
 
-struct virtualpage
+void vm_activate(struct addrspace *as);
+void vm_asid_release(struct addrspace *as);
+int vm_hwpt_create(struct addrspace *as);
+pte_t *vm_pt_alloc(void);
+void vm_pt_free(pte_t *pt);
+void vm_hwpt_destroy(struct addrspace *as);
+
+int vm_willneed(struct addrspace *as, vaddr_t vaddr);
+unsigned vm_unmap(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+int vm_syncfile(struct vnode *vn);
+struct anonobj *vm_anon_create(uint32_t npages);
+void vm_anon_incref(struct anonobj *obj);
+void vm_anon_decref(struct anonobj *obj);
+
+/* page replacement policies */
+#define VM_EVICT_FIFO	0	/* round robin over user frames */
+#define VM_EVICT_CLOCK	1	/* two-handed clock on the referenced bit */
+
+/*
+ * Who may change a page table entry: its owner, under its as_lock,
+ * while the page is pinned or not in memory; an evictor, under the
+ * coremap lock, once it has claimed the frame and set VPAGE_BUSY.
+ * Never both at once, so a plain read-modify-write of the word is safe.
+ */
+
+/* One mapping of a shared text frame, see struct memorypage. */
+struct rmap
 {
-	index_t coremapindex;	//this traslates to physical address coremapindex * PAGE_SIZE
-	index_t swapfileoffset;
-	uint8_t permission:3;
-	uint8_t status:3;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	struct rmap *next;
 };
 
+/*
+ * The memory behind a MAP_SHARED|MAP_ANON mapping. A forked child's
+ * copy of the region refers to the same object, and its pages live in
+ * the page cache under it the way a shared file mapping's live under
+ * their vnode, so every sharer faults the one frame in when it first
+ * touches a page. A page that gets evicted is written to swap, and
+ * slots remembers where; it is read back from there the next time
+ * anybody touches it. Pages come and go with the object, not with the
+ * regions using it, so refcount (under the coremap lock) counts those.
+ */
+struct anonobj
+{
+	uint32_t refcount;
+	uint32_t npages;
+	index_t *slots;	//swap slot of each page, ANON_NOSLOT until it is first written out
+};
+
+#define ANON_NOSLOT ((index_t)0xFFFF)
+
+/* most frames the pre-zeroed pool will hold, and how many it starts out wanting */
+#define ZEROPOOL_MAX 64
+#define ZEROPOOL_DEFAULT 16
+
+/* buckets in the text page cache */
+#define PAGECACHE_SIZE 128
+
+/* frames remembered behind sequential scans */
+#define DROPQ_SIZE 32
+
 struct memorypage
 {
 
@@ -180,6 +274,78 @@ struct memorypage
     //uint64_t timestamp;
     struct addrspace *as;
     vaddr_t vpage;
+
+    /*
+     * Number of address spaces mapping this frame. More than one means
+     * the frame is shared copy-on-write after a fork; it is mapped
+     * read-only everywhere and copied on the first write. When the
+     * owner (as) drops its mapping, as is set to NULL and the next
+     * sharer to fault on the page claims it.
+     */
+    uint32_t refcount;
+
+    /*
+     * Buddy allocator: a frame that heads a free block of 2^freeorder
+     * frames is linked on freeheads[freeorder]. freeorder is -1 for
+     * every other frame, including the rest of a free block.
+     */
+    int8_t freeorder;
+    index_t nextfree;
+    index_t prevfree;
+
+    /*
+     * Set whenever vm_fault loads a translation for the frame. The
+     * clock's front hand clears it and drops the TLB entry, so a page
+     * that is still in use faults once more and gets it set again.
+     */
+    bool referenced;
+
+    /* on the pageout daemon's queue of clean, reclaimable frames */
+    bool queued;
+
+    /* read in by swap or sequential readahead and not touched yet */
+    bool prefetched;
+
+    /* left behind by a MADV_SEQUENTIAL scan, on the drop-behind queue */
+    bool dropbehind;
+
+    /*
+     * Pinned: a fault is mapping the frame, it is in the middle of
+     * swap I/O, or an evictor has claimed it. Busy frames are never
+     * evicted or shared; threads that need one sleep until it clears.
+     */
+    bool busy;
+
+    /*
+     * Text page cache. A read-only page of an executable is kept
+     * under (cachevn, cacheoff, vpage), cacheoff being the file offset
+     * of its segment, so every process running the file maps the same
+     * frame. Such a frame has no owner (as is NULL); rmap lists all
+     * refcount mappings instead, and it leaves the cache when the last
+     * one goes. Always clean: evicting it just unmaps it everywhere.
+     *
+     * Pages of MAP_SHARED file mappings live here too, keyed by their
+     * own file offset with vpage 0, so every mapper writes the same
+     * frame. They can be dirty; cleaning one writes it to its file.
+     *
+     * So do pages of shared anonymous memory, under their anonobj
+     * (cachevn NULL) and their offset into it. The object holds a
+     * reference of its own, so such a frame stays when its last
+     * mapping goes; cleaning one writes it to the object's swap slot.
+     */
+    bool cached;
+    struct vnode *cachevn;
+    struct anonobj *cacheanon;
+    uint32_t cacheoff;
+    index_t nextcached;
+    struct rmap *rmap;
+
+    /*
+     * kmalloc's bookkeeping for a frame it has cut up into subpage
+     * blocks (see vm_setkmowner), NULL otherwise. Lets kfree find a
+     * block's size class without taking the kmalloc lock.
+     */
+    void *kmowner;
     //add more stuff here
 };
 
@@ -194,13 +360,127 @@ struct struct_coremap
 	bool bisbootstrapdone;
     int swapcounter;
 
+	index_t freeheads[COREMAP_MAXORDER + 1];	//free blocks by order
+	index_t nfreepages;	//free frames over all orders
+
+	uint32_t nmultialloc;	//multi-page allocations
+	uint32_t nmultievict;	//... that had to evict user pages to get a run
+
+	int policy;	//VM_EVICT_*, see vm_setpolicy
+	int clockfront;	//front hand of the clock, swapcounter is the back hand
+	uint32_t nevictions;	//frames taken away from user pages
+	uint32_t nwritebacks;	//... of which had to be written to swap by the faulting thread
+	uint32_t nrefaults;	//faults that read a page back from swap
+	uint32_t nfilereads;	//faults that read a page from its file
+	uint32_t ndiscards;	//evicted clean file pages, dropped rather than swapped
+	uint32_t nfilewrites;	//dirty shared mapping pages written back to their file
+	uint32_t ncached;	//frames in the text page cache
+	uint32_t ncachehits;	//text faults that found the page already in memory
+
+	/*
+	 * Frames a MADV_SEQUENTIAL scan has gone past. The evictors take
+	 * these before asking the replacement policy, unless they have
+	 * been touched again since. When full, the oldest is forgotten.
+	 */
+	index_t dropq[DROPQ_SIZE];
+	uint32_t dropqhead, dropqlen;
+	uint32_t nseqreads;	//file pages read ahead of sequential scans
+	uint32_t ndropbehind;	//victims taken from behind them
+	uint32_t nwillneed;	//pages brought in early for MADV_WILLNEED
+	uint32_t ndontneed;	//pages thrown away for MADV_DONTNEED
+
+	index_t zeroframe;	//read-only page of zeros mapped for reads of untouched pages
+	uint32_t nzeroreads;	//read faults that mapped the zero page
+	uint32_t nzerowrites;	//writes that then had to give the page a frame of its own
+
+	/*
+	 * Free frames zeroed ahead of time by the zeroing thread, taken
+	 * off the buddy lists (PAGE_FIXED) while they wait here.
+	 */
+	index_t zeropool[ZEROPOOL_MAX];
+	uint32_t nzeropool;
+	uint32_t zeropooltarget;	//tunable, vm_setzeropool
+	bool zerowanted;
+	uint32_t nzerohits;	//zeroed allocations served from the pool
+	uint32_t nzeromisses;	//zeroed allocations that had to zero on the spot
+	uint32_t nzeroidle;	//frames the zeroing thread zeroed
+
+	/*
+	 * Pageout daemon. It wakes when free frames drop below lowater
+	 * and cleans eviction candidates until free + clean frames reach
+	 * hiwater. Cleaned frames go on cleanq for allocators to take.
+	 */
+	uint32_t lowater, hiwater;
+	index_t *cleanq;	//ring of numpages entries
+	uint32_t cleanqhead, cleanqlen;
+	bool pageoutwanted;
+	uint32_t npageouts;	//pages cleaned by the daemon
+	uint32_t ncleanreclaims;	//frames allocators took from cleanq
+
+	uint32_t nwaiters;	//threads sleeping for a busy frame or page
+
+	uint32_t nactivations;	//as_activate calls
+	uint32_t nasids;	//ASIDs handed out
+	uint32_t nasidflushes;	//TLB flushes for running out of ASIDs
+
+	uint32_t nfaults;	//TLB misses the refill handler passed to vm_fault (approximate)
+	uint32_t nhwpttables;	//second-level hardware page tables allocated
+
 }g_coremap;
 
+/*
+ * Swap slots are pages of swap space, tracked in a bitmap. Swap space
+ * is the file os161.swap unless raw disks were given with vm_swapon;
+ * then slots are striped over the disks SWAP_STRIPE pages at a time.
+ */
+#define SWAP_MAXSLOTS 16384	/* 64M of swap */
+#define SWAP_CLUSTER 64		/* slots set aside for a process that starts swapping */
+#define SWAP_MAXDEVS 4
+#define SWAP_STRIPE 8
+#define SWAP_MAXBATCH 8		/* most pages moved by one swap I/O */
+#define SEQ_WINDOW SWAP_MAXBATCH	/* pages read ahead of, and dropped behind, a sequential scan */
+
+struct swapdev
+{
+	char *name;
+	struct device *dev;
+	uint32_t npages;	//capacity
+	uint32_t nreads;	//pages read
+	uint32_t nwrites;	//pages written
+};
+
+/*
+ * Swap I/O runs without any global lock; the slot bitmap has its own
+ * spinlock and pages in transit are marked busy. lk_swapper only
+ * serializes vm_swapon.
+ */
 struct struct_swapper
 {
         struct vnode *swapfile;
-        off_t fileend;
         struct lock *lk_swapper;
+
+        struct swapdev devs[SWAP_MAXDEVS];
+        unsigned ndevs;
+        uint32_t nslots;	//usable slots, at most SWAP_MAXSLOTS
+
+        struct bitmap *slotmap;	//one bit per slot, set while in use
+        uint32_t cursor;	//where the next process without slots starts looking
+        uint32_t slotsinuse;
+        uint32_t maxslotsinuse;
+
+        /*
+         * Dirty pages are written out together with their dirty
+         * neighbours in the address space, into adjacent slots. A
+         * swap-in reads up to rawindow following pages along with the
+         * faulting one; the window grows when those pages get used and
+         * shrinks when they are evicted untouched.
+         */
+        uint32_t nclusterwrites;	//swap writes
+        uint32_t nclusterpages;	//pages they carried
+        uint32_t rawindow;
+        uint32_t nprefetched;
+        uint32_t nrahits;
+        uint32_t nrawasted;
 }g_swapper;
 
 void dumpcoremap(void);
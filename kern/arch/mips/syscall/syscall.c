@@ -162,6 +162,10 @@ syscall(struct trapframe *tf)
 		err = sys___getcwd((userptr_t )tf->tf_a0, tf->tf_a1, &retval);
 		break;
 
+	case SYS_fsync:
+		err = sys_fsync(tf->tf_a0);
+		break;
+
 		/*****************************************END FILE SYSTEM CALLS**************************************/
 
 		/**************************************** START OF PROCESS SYSTEM CALLS ***************************/
@@ -189,6 +193,20 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk(tf->tf_a0, &ret);
 		retval = (int32_t)ret;
 		break;
+
+	case SYS_mmap:
+		//fd and offset are the 5th and 6th arguments, on the user stack
+		err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3, tf->tf_sp, &ret);
+		retval = (int32_t)ret;
+		break;
+
+	case SYS_munmap:
+		err = sys_munmap(tf->tf_a0, tf->tf_a1);
+		break;
+
+	case SYS_madvise:
+		err = sys_madvise(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
 		/*****************************************END OF PROCESS SYSTEM CALLS******************/
 
 		/* Add stuff here */
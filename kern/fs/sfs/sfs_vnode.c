@@ -44,11 +44,35 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <kmemcache.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Storage for struct sfs_vnode, shared by all sfs mounts. */
+static struct kmem_cache *sfs_vnodecache;
+
+/*
+ * Create the vnode cache, if this is the first mount. Called by
+ * sfs_domount with the vfs biglock held.
+ */
+int
+sfs_vnodecache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_vnodecache == NULL) {
+		sfs_vnodecache = kmem_cache_create("sfs_vnode",
+						   sizeof(struct sfs_vnode),
+						   0, NULL, NULL);
+		if (sfs_vnodecache == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +977,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnodecache, sv);
 
 	/* Done */
 	return 0;
@@ -1110,14 +1134,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any file can be mapped: the VM system pages it
+ * in and out with VOP_READ and VOP_WRITE, so there is nothing to set
+ * up here.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -1685,7 +1711,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnodecache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1725,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -1736,7 +1762,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -1747,7 +1773,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnodecache, sv);
 		return result;
 	}
 
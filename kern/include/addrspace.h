@@ -36,18 +36,37 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct anonobj;
 
+/*
+ * A region of the address space: one of the segments loadelf defines,
+ * the heap, the stack or an mmap(). Only pages inside a region are
+ * valid. The list is kept sorted by address, so faults, fork and exit
+ * walk just what is mapped.
+ */
 struct segment
 {
 	vaddr_t startaddress;
 	int	npages;
-	int8_t actualpermission;
+	int8_t permission;	//what faults check, writable while loading
+	int8_t actualpermission;	//what the executable asked for
+	struct vnode *vn;	//file the first filesize bytes come from, NULL for anonymous memory
+	struct anonobj *anon;	//shared anonymous memory only, what its pages live in
+	off_t fileoffset;	//of the region's start in vn, or in anon
+	size_t filesize;
+	int8_t flags;	//SEG_*
+	int8_t advice;	//MADV_*, how madvise says the region is used
 	struct segment* next;
 };
 
+#define SEG_MMAP	0x1	//made by mmap, munmap may take it away
+#define SEG_SHARED	0x2	//writes go to the file (or, anonymous, to the other processes)
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -68,9 +87,14 @@ struct addrspace {
 	/* Put stuff here for your VM system */
 	vaddr_t as_heapbase,as_heapend;
 	vaddr_t as_sttop;
-	struct virtualpage ** uberArray[NUM_UBERPAGES];
-	struct segment* segmentll;
+	pte_t *uberArray[NUM_UBERPAGES];	//second-level tables of NUM_SUBPAGES entries, NULL until used
+	struct segment* segmentll;	//regions, sorted by address
+	struct segment *as_heap, *as_stack;	//on segmentll once as_define_stack has run
 	int tlbclock;
+	int32_t as_swaphint;	//slot after our last swap allocation, -1 if none
+	struct lock *as_lock;	//held by faults and as_copy while they change the page table
+	uint32_t as_asid[MAXCPUS];	//per-cpu ASID and its generation, 0 if none
+	uint32_t **as_hwpt;	//EntryLo words for the UTLB refill handler, see smartvm.c
 
 #endif
 };
@@ -96,7 +120,8 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Its first FILESIZE bytes are paged in from
+ *                OFFSET in V on demand (V may be NULL for none).
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
@@ -107,6 +132,20 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_findhole - find NPAGES of unused address space between the
+ *                heap and the stack for a mapping. Returns 0 if there
+ *                is no such hole.
+ *
+ *    as_define_mapping - add an mmap() region of NPAGES pages at VADDR.
+ *
+ *    as_unmap  - take the pages from VADDR to VADDR+NPAGES out of
+ *                whatever mmap() regions they are in, writing shared
+ *                file pages back first.
+ *
+ *    as_advise - act on madvise() ADVICE for the pages from VADDR to
+ *                VADDR+NPAGES. Access pattern advice applies to all
+ *                of every region the range touches.
  */
 
 struct addrspace *as_create(void);
@@ -118,13 +157,22 @@ int               as_define_region(struct addrspace *as,
 		vaddr_t vaddr, size_t sz,
 		int readable,
 		int writeable,
-		int executable);
+		int executable,
+		struct vnode *v,
+		off_t offset,
+		size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
-
-void as_init_uberarray_section(struct addrspace *as, int index);
-struct virtualpage* as_init_virtualpage(void);
+vaddr_t           as_findhole(struct addrspace *as, uint32_t npages);
+int               as_define_mapping(struct addrspace *as, vaddr_t vaddr,
+		uint32_t npages, int8_t permission, int8_t flags,
+		struct vnode *v, off_t offset, size_t filesize);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, uint32_t npages);
+int               as_advise(struct addrspace *as, vaddr_t vaddr, uint32_t npages, int advice);
+
+int as_init_uberarray_section(struct addrspace *as, int index);
+struct segment *as_findregion(struct addrspace *as, vaddr_t vaddr);
 
 /*
  * Functions in loadelf.c
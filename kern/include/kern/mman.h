@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap() and munmap().
+ */
+
+/* Protection: what the mapping may be used for */
+#define PROT_NONE     0      /* No access */
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags: exactly one of MAP_SHARED and MAP_PRIVATE, plus maybe others */
+#define MAP_SHARED    0x01   /* Writes go to the file and other mappers */
+#define MAP_PRIVATE   0x02   /* Writes stay in this process */
+#define MAP_FIXED     0x10   /* Map at exactly the address given */
+#define MAP_ANON      0x1000 /* No file, pages start out zeroed */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* What mmap() returns on failure */
+#define MAP_FAILED    ((void *)-1)
+
+/* Advice for madvise(): how the pages are going to be used */
+#define MADV_NORMAL     0    /* No idea; the default */
+#define MADV_RANDOM     1    /* In no particular order: don't read ahead */
+#define MADV_SEQUENTIAL 2    /* Front to back, once: read well ahead, drop behind */
+#define MADV_WILLNEED   3    /* Soon: bring them in now */
+#define MADV_DONTNEED   4    /* Not any more: throw them away */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Caches of constructed kernel objects of one type, on top of kmalloc.
+ *
+ * A freed object keeps whatever its constructor set up (locks, wait
+ * channels, stacks) and goes on its cache's free list, so the next
+ * allocation can hand it straight back. Only when the free list is
+ * full, or memory runs short, is the destructor run and the memory
+ * kfree'd. Code that uses a cache must therefore free objects in the
+ * state the constructor leaves them, as far as the constructed parts
+ * go.
+ *
+ * Functions:
+ *     kmem_cache_create  - make a cache of SIZE-byte objects, keeping
+ *                          up to MAXFREE constructed ones on hand (0
+ *                          picks a default). CTOR and DTOR may be NULL;
+ *                          CTOR returns an error code. DTOR is called
+ *                          with no cache locks held, but must not
+ *                          sleep, since kmalloc may reap from any
+ *                          context it is called in. Returns NULL on
+ *                          error.
+ *     kmem_cache_destroy - destroy a cache, which must have no objects
+ *                          allocated.
+ *     kmem_cache_alloc   - get a constructed object, or NULL.
+ *     kmem_cache_free    - give an object back.
+ *     kmem_cache_reap    - destroy every cached free object in every
+ *                          cache; returns how many. kmalloc calls this
+ *                          when it runs out of memory, and the pageout
+ *                          daemon before it starts evicting user pages.
+ *     kmem_cache_printstats - print per-cache statistics.
+ */
+
+
+struct kmem_cache;  /* Opaque. */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     unsigned maxfree,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEMCACHE_H_ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2000, 2001
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+/*
+ * kmalloc profiler, built in with "options kmallocprof".
+ *
+ * Every live kmalloc block is recorded in a fixed side table along
+ * with the address kmalloc was called from, so the heap can be broken
+ * down by call site. Blocks allocated while the table is full aren't
+ * tracked and are counted separately. Only the immediate caller is
+ * recorded: memory from wrappers like kstrdup or kmem_cache_alloc is
+ * charged to the wrapper. Feed the addresses to os161-addr2line.
+ *
+ * Functions:
+ *     kmprof_alloc    - record block PTR of SZ bytes from CALLER.
+ *     kmprof_free     - forget block PTR; must be called before the
+ *                       memory is actually released.
+ *     kmprof_snapshot - remember every call site's live totals.
+ *     kmprof_report   - print live bytes and blocks per call site,
+ *                       largest first. If DIFF is true, print only
+ *                       what changed since the last snapshot.
+ */
+
+void kmprof_alloc(void *ptr, size_t sz, vaddr_t caller);
+void kmprof_free(void *ptr);
+void kmprof_snapshot(void);
+void kmprof_report(bool diff);
+
+
+#endif /* _KMPROF_H_ */
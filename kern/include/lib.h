@@ -126,6 +126,9 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/* Called by the VM system once it can keep page owners (vm_setkmowner). */
+void kheap_bootstrap(void);
+
 /*
  * C string functions. 
  *
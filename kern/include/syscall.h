@@ -67,6 +67,7 @@ int sys_close(int fd);
 int sys_dup2(int oldfd, int newfd, int *);
 int sys_chdir(userptr_t pathname);
 int sys___getcwd(userptr_t buf, size_t buflen, int32_t *ret);
+int sys_fsync(int fd);
 
 //ASST2 Process syscalls
 pid_t sys_getpid(void);
@@ -75,6 +76,9 @@ int sys_execv(userptr_t program, userptr_t args);
 int sys_waitpid(pid_t pid, userptr_t status, int options,int*, int);
 void sys_exit(int exitcode);
 int sys_sbrk(intptr_t amt, vaddr_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int sp, vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_madvise(vaddr_t addr, size_t len, int advice);
 
 void child_fork(void* data1, unsigned long data2);
 
@@ -133,6 +133,10 @@ struct filehandle
 	int8_t isSeekable;
 };
 
+//filehandles come from this cache with lk_fileaccess already created
+extern struct kmem_cache *g_fhcache;
+void filehandle_bootstrap(void);
+
 struct pidentry
 {
 	struct thread* thread;
@@ -157,6 +157,10 @@ off_t vfs_lseek(struct vnode *vn, off_t pos);
  *                    MOUNTFUNC, which should create a struct fs and
  *                    return it in RESULT.
  *
+ *    vfs_swapon    - Claim the (unmounted) device named by DEVNAME for
+ *                    swap space and hand back its struct device. It
+ *                    cannot be mounted afterwards.
+ *
  *    vfs_unmount   - Unmount the filesystem presently mounted on the
  *                    specified device.
  *
@@ -175,6 +179,7 @@ int vfs_mount(const char *devname, void *data,
 	      int (*mountfunc)(void *data,
 			       struct device *dev, 
 			       struct fs **result));
+int vfs_swapon(const char *devname, struct device **result);
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
 
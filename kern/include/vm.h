@@ -48,6 +48,9 @@
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Start the pageout daemon (needs threads and the VFS) */
+void vm_pageout_bootstrap(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -55,6 +58,26 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Attach kmalloc's bookkeeping to a kernel heap page, or look it up.
+ * Until vm_bootstrap is done there's nowhere to keep it; kmalloc
+ * catches up on its older pages in kheap_bootstrap.
+ */
+void vm_setkmowner(vaddr_t kaddr, void *owner);
+void *vm_getkmowner(vaddr_t kaddr);
+
+/* Print VM system statistics (kernel menu) */
+void vm_printstats(void);
+
+/* Select the page replacement policy by name ("fifo" or "clock") */
+int vm_setpolicy(const char *name);
+
+/* Add a raw disk (e.g. "lhd1raw") to swap space */
+int vm_swapon(const char *devname);
+
+/* Set how many pre-zeroed frames to keep for page faults */
+int vm_setzeropool(unsigned nframes);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
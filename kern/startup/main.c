@@ -128,7 +128,9 @@ boot(void)
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
+	vm_pageout_bootstrap();
 	g_lk_pid=lock_create("createPIDLock");
+	filehandle_bootstrap();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -36,6 +36,8 @@
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -43,6 +45,10 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-kmallocprof.h"
+#if OPT_KMALLOCPROF
+#include <kmprof.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -395,10 +401,97 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 	
 	return 0;
 }
 
+#if OPT_KMALLOCPROF
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kmprof_report(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "snap")) {
+		kmprof_snapshot();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "diff")) {
+		kmprof_report(true);
+	}
+	else {
+		kprintf("Usage: kmprof [snap|diff]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+#endif
+
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy fifo|clock\n");
+		return EINVAL;
+	}
+
+	return vm_setpolicy(args[1]);
+}
+
+static
+int
+cmd_vmzero(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmzero nframes\n");
+		return EINVAL;
+	}
+
+	return vm_setzeropool(atoi(args[1]));
+}
+
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	char *device;
+	int i, result;
+
+	if (nargs < 2) {
+		kprintf("Usage: swapon device: [device: ...]\n");
+		return EINVAL;
+	}
+
+	for (i=1; i<nargs; i++) {
+		device = args[i];
+
+		/* Allow (but do not require) colon after device name */
+		if (device[strlen(device)-1]==':') {
+			device[strlen(device)-1] = 0;
+		}
+
+		result = vm_swapon(device);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -438,6 +531,9 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[vmpolicy] Page replacement policy  ",
+	"[vmzero]  Pre-zeroed frames to keep ",
+	"[swapon]  Swap to raw disk(s)       ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -459,6 +555,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -500,6 +597,10 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[vm] VM system stats                ",
+#if OPT_KMALLOCPROF
+	"[kmprof] kmalloc call sites         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -540,6 +641,9 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "vmzero",	cmd_vmzero },
+	{ "swapon",	cmd_swapon },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -548,12 +652,17 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",         cmd_vmstats },
+#if OPT_KMALLOCPROF
+	{ "kmprof",     cmd_kmprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -12,6 +12,9 @@
 #include <kern/stat.h>
 #include <vnode.h>
 #include <copyinout.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include "opt-dumbvm.h"
 
 int createfd(struct thread* thread)
 {
@@ -86,13 +89,12 @@ int sys_open(userptr_t filename, int flags, int32_t *fd, ...)
 		return ENFILE;
 
 	//only create this if its not already there.
-	struct filehandle *fh = kmalloc(sizeof(struct filehandle));
+	struct filehandle *fh = kmem_cache_alloc(g_fhcache);
 	if(fh==NULL)
 		panic("Memory allocation for file handle failed");
 	fh->fileobject = file_vnode;
 	fh->offset = 0;
 	fh->open_mode = flags;
-	fh->lk_fileaccess = lock_create("filelock");
 	fh->refcount = 1;
 	fh->isSeekable = 1;
 
@@ -102,6 +104,31 @@ int sys_open(userptr_t filename, int flags, int32_t *fd, ...)
 	return 0;
 }
 
+struct kmem_cache *g_fhcache;
+
+//the lock is the expensive part of a filehandle, so cached ones keep theirs
+static int filehandle_ctor(void *obj)
+{
+	struct filehandle *fh = obj;
+	fh->lk_fileaccess = lock_create("filelock");
+	if(fh->lk_fileaccess == NULL)
+		return ENOMEM;
+	return 0;
+}
+
+static void filehandle_dtor(void *obj)
+{
+	struct filehandle *fh = obj;
+	lock_destroy(fh->lk_fileaccess);
+}
+
+void filehandle_bootstrap(void)
+{
+	g_fhcache = kmem_cache_create("filehandle", sizeof(struct filehandle), 0, filehandle_ctor, filehandle_dtor);
+	if(g_fhcache == NULL)
+		panic("filehandle_bootstrap: out of memory");
+}
+
 /*
 Description
 read reads up to buflen bytes from the file specified by fd, at the location in the file specified by the current seek position of the file, and stores them in the space pointed to by buf. The file must be open for reading.
@@ -136,6 +163,8 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int32_t *bytesread)
 	struct iovec iov;
 	struct uio ku;
 	char *readbuf = (char*)kmalloc(buflen);
+	if(readbuf == NULL)
+		return ENOMEM;
 	lock_acquire(fh->lk_fileaccess);
 	uio_kinit(&iov, &ku, readbuf, buflen, fh->offset, UIO_READ);
 
@@ -143,6 +172,7 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int32_t *bytesread)
 	if(err)
 	{
 		lock_release(fh->lk_fileaccess);
+		kfree(readbuf);
 		return err;
 	}
 
@@ -157,11 +187,8 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int32_t *bytesread)
 
 	lock_release(fh->lk_fileaccess);
 	err = copyout(readbuf, buf, *bytesread);
-	if(err)
-		return err;
-
 	kfree(readbuf);
-	return 0;
+	return err;
 }
 
 /*
@@ -326,14 +353,43 @@ int sys_close(int fd)
 	if(fh->refcount == 0)
 	{
 		vfs_close(fh->fileobject);
-		lock_destroy(fh->lk_fileaccess);
-		kfree(fh);
+		kmem_cache_free(g_fhcache, fh);
 	}
 	cur->filetable[fd] = NULL;
 	//	while(1);
 	return 0;
 }
 
+/*
+Description
+All data buffered in memory for the file referenced by fd is written to disk, including pages of it that are mapped shared and have been written through the mapping (by any process).
+
+Return Values
+On success, fsync returns 0. On error, -1 is returned, and errno is set according to the error encountered.
+Errors
+The following error codes should be returned under the conditions given. Other error codes may be returned for other errors not mentioned here.
+
+
+    EBADF		fd is not a valid file handle.
+    EIO		A hard I/O error occurred.
+ */
+int sys_fsync(int fd)
+{
+	if(fd<0||fd>=OPEN_MAX)
+		return EBADF;
+	struct filehandle* fh;
+	struct thread *cur = (struct thread*)curthread;
+	fh = cur->filetable[fd];
+	if(fh == NULL)
+		return EBADF;
+	int err = 0;
+#if !OPT_DUMBVM
+	err = vm_syncfile(fh->fileobject);	//dirty mapped pages first, then the file system's buffers
+#endif
+	int err2 = VOP_FSYNC(fh->fileobject);
+	return err ? err : err2;
+}
+
 /*
  Description
 dup2 clones the file handle oldfd onto the file handle newfd. If newfd names an open file, that file is closed.
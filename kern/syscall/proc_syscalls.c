@@ -14,6 +14,9 @@
 #include <synch.h>
 #include <copyinout.h>
 #include <kern/wait.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <vnode.h>
 void clonetrapframe(struct trapframe *inframe, struct trapframe *returnframe)
 {
 	//struct trapframe* returnframe = kmalloc(sizeof(struct trapframe));
@@ -551,14 +554,192 @@ int sys_sbrk(intptr_t amt, vaddr_t *retval)
 	struct addrspace* as = curthread->t_addrspace;
 	vaddr_t oldaddr = as->as_heapend;
 	vaddr_t newaddr = as->as_heapend + amt;
+	if(amt < 0 && (vaddr_t)-amt > oldaddr - as->as_heapbase)
+		return EINVAL;	//below the start of the heap
 	if(newaddr < as->as_heapbase)
 		return EINVAL;
-	if(newaddr > as->as_sttop)
+	lock_acquire(as->as_lock);
+	if(newaddr > (as->as_heap->next->startaddress & PAGE_FRAME))
+	{
+		//up against the first mapping above it, or the stack
+		lock_release(as->as_lock);
 		return ENOMEM;
-	//need to check for stack passing
+	}
 	as->as_heapend = newaddr;
+	uint32_t npages = BYTES_TO_PAGES((newaddr - as->as_heapbase));
+	if(npages < (uint32_t)as->as_heap->npages)
+	{
+		//shrinking: the pages wholly above the new break go back now, frames, swap slots and all
+		vm_unmap(as, as->as_heapbase + npages * PAGE_SIZE, as->as_heap->npages - npages);
+	}
+	as->as_heap->npages = npages;	//faults still stop at the break
+	lock_release(as->as_lock);
 	*retval = oldaddr;
 	return 0;
 }
 
+/*
+Description
+mmap maps len bytes of the file fd, starting at offset, into the address space and returns where. With MAP_ANON there is no file (fd and offset are ignored) and the memory starts out zeroed. Pages are read from the file as they are first touched.
+
+prot is PROT_NONE or any of PROT_READ, PROT_WRITE and PROT_EXEC. flags has exactly one of
+
+    MAP_SHARED		Writes go to the file (written back on munmap, fsync, exit or eviction), and every process mapping it sees them. Anonymous shared memory is shared with children forked later.
+    MAP_PRIVATE		Writes stay in this process; the file is never changed.
+
+and may have MAP_FIXED, to map at exactly addr (page aligned, between the heap and the stack) in place of any mapping already there. Otherwise addr is ignored and the mapping goes as high up below the stack as it fits.
+
+offset must be a multiple of the page size. Bytes of the last page past the end of the file read as zeros and are not written back.
+
+Return Values
+On success, mmap returns the address of the mapping. On error, MAP_FAILED is returned, and errno is set according to the error encountered.
+Errors
+
+    EBADF		fd is not a valid file handle and MAP_ANON was not given.
+    EACCES		fd is not open for reading, or MAP_SHARED and PROT_WRITE were asked for and it is not open for writing too.
+    ENODEV		fd refers to something that cannot be mapped.
+    EINVAL		len is 0, offset or (with MAP_FIXED) addr is not aligned or out of range, or flags is bad.
+    ENOMEM		There is no room for len bytes in the address space.
+ */
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int sp, vaddr_t *retval)
+{
+	struct addrspace* as = curthread->t_addrspace;
+	struct vnode *vn = NULL;
+	size_t filesize = 0;
+	int8_t permission = 0;
+	int32_t fd;
+	off_t offset;
+	uint32_t npages;
+	int err;
+
+	err = copyin((userptr_t)sp+16, &fd, sizeof(int32_t));
+	if(err)
+		return err;
+	err = copyin((userptr_t)sp+24, &offset, sizeof(off_t));	//a 64-bit argument takes an aligned pair of slots
+	if(err)
+		return err;
+	if(len == 0 || len > USERSTACK)
+		return EINVAL;
+	if(offset < 0 || offset % PAGE_SIZE != 0 || offset + len > 0xffffffff)	//the page cache keeps 32-bit offsets
+		return EINVAL;
+	if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+		return EINVAL;
+	if((flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0)
+		return EINVAL;
+	npages = BYTES_TO_PAGES(len);
+	if(prot & PROT_READ)
+		permission |= 0x4;
+	if(prot & PROT_WRITE)
+		permission |= 0x2;
+	if(prot & PROT_EXEC)
+		permission |= 0x1;
+
+	if((flags & MAP_ANON) == 0)
+	{
+		struct filehandle* fh;
+		struct stat st;
+
+		if(fd<0||fd>=OPEN_MAX)
+			return EBADF;
+		fh = curthread->filetable[fd];
+		if(fh == NULL)
+			return EBADF;
+		if((fh->open_mode & O_ACCMODE) == O_WRONLY)
+			return EACCES;
+		if((flags & MAP_SHARED) && (prot & PROT_WRITE) && (fh->open_mode & O_ACCMODE) != O_RDWR)
+			return EACCES;
+		err = VOP_MMAP(fh->fileobject);
+		if(err)
+			return err == EUNIMP ? ENODEV : err;
+		err = VOP_STAT(fh->fileobject, &st);
+		if(err)
+			return err;
+		if(st.st_size > offset)
+			filesize = st.st_size - offset < npages * PAGE_SIZE ? st.st_size - offset : npages * PAGE_SIZE;
+		vn = fh->fileobject;
+	}
+
+	lock_acquire(as->as_lock);
+	if(flags & MAP_FIXED)
+	{
+		//written so that addr + len can't wrap past the top of the address space
+		if(addr % PAGE_SIZE != 0 || addr < as->as_heapbase || addr >= as->as_stack->startaddress
+				|| npages * PAGE_SIZE > as->as_stack->startaddress - addr)
+			err = EINVAL;
+		else
+			err = as_unmap(as, addr, npages);	//replaces whatever was mapped there
+	}
+	else
+	{
+		addr = as_findhole(as, npages);
+		if(addr == 0)
+			err = ENOMEM;
+	}
+	if(err == 0)
+		err = as_define_mapping(as, addr, npages, permission, (flags & MAP_SHARED) ? SEG_SHARED : 0, vn, offset, filesize);
+	lock_release(as->as_lock);
+	if(err)
+		return err == EFAULT ? EINVAL : err;	//EFAULT: on top of the heap or the program
+	*retval = addr;
+	return 0;
+}
+
+/*
+Description
+munmap removes the mappings made by mmap for the len bytes from addr, which must be page aligned. Dirty pages of shared file mappings are written back to the file first. Addresses in the range that are not mapped by mmap are left alone. Only this process loses the pages: other processes sharing an anonymous mapping keep theirs, and a new mapping at the same address starts out zeroed.
+
+Return Values
+On success, munmap returns 0. On error, -1 is returned, and errno is set according to the error encountered.
+Errors
+
+    EINVAL		addr is not aligned, len is 0, or the range is not all user addresses.
+    ENOMEM		Splitting a mapping in two needed memory that was not available.
+ */
+int sys_munmap(vaddr_t addr, size_t len)
+{
+	struct addrspace* as = curthread->t_addrspace;
+	int err;
+
+	if(addr % PAGE_SIZE != 0 || len == 0 || addr >= USERSTACK || len > USERSTACK - addr)
+		return EINVAL;
+	lock_acquire(as->as_lock);
+	err = as_unmap(as, addr, BYTES_TO_PAGES(len));
+	lock_release(as->as_lock);
+	return err;
+}
+
+/*
+Description
+madvise tells the VM system how the len bytes from addr (page aligned) are going to be used. advice is one of
+
+    MADV_NORMAL		No particular pattern; the default.
+    MADV_RANDOM		Touched in no particular order: pages are read in one at a time, with no readahead.
+    MADV_SEQUENTIAL	Touched front to back, once: faults read well ahead, and pages the scan has gone past are evicted before anything else.
+    MADV_WILLNEED	Needed soon: pages in swap or still in the file are read in right away.
+    MADV_DONTNEED	Not needed any more: the pages are thrown away, freeing their memory and swap. Next time they read as zeros, or again from the file they were mapped from.
+
+MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL apply to the whole of every region (segment, heap, stack or mapping) the range touches.
+
+Return Values
+On success, madvise returns 0. On error, -1 is returned, and errno is set according to the error encountered.
+Errors
+
+    EINVAL		addr is not aligned, len is 0, or advice is not one of the above, or it is MADV_DONTNEED and the range touches a shared anonymous mapping (whose pages can't be thrown away without breaking the sharing).
+    ENOMEM		Part of the range is not mapped. The advice is still taken for the parts that are.
+ */
+int sys_madvise(vaddr_t addr, size_t len, int advice)
+{
+	struct addrspace* as = curthread->t_addrspace;
+	int err;
+
+	if(addr % PAGE_SIZE != 0 || len == 0 || addr >= USERSTACK || len > USERSTACK - addr)
+		return EINVAL;
+	if(advice < MADV_NORMAL || advice > MADV_DONTNEED)
+		return EINVAL;
+	lock_acquire(as->as_lock);
+	err = as_advise(as, addr, BYTES_TO_PAGES(len), advice);
+	lock_release(as->as_lock);
+	return err;
+}
+
 
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
+#include <kmemcache.h>
 
 int kstrcpy(char* src, char* dest)
 {
@@ -157,13 +158,12 @@ runprogram(char *progname,char** args, unsigned long nargs)
 	int err = vfs_open(con, O_RDONLY, 0x660, &std);
 	if(err)
 		KASSERT("Initializing STDIN failed");
-	struct filehandle *fh = kmalloc(sizeof(struct filehandle));
+	struct filehandle *fh = kmem_cache_alloc(g_fhcache);
 	if(fh==NULL)
 		KASSERT("Memory allocation for file handle failed");
 	fh->fileobject = std;
 	fh->offset = 0;
 	fh->open_mode = O_RDONLY;
-	fh->lk_fileaccess = lock_create("filelock");
 	fh->refcount = 0;
 	fh->isSeekable = 0;
 
@@ -174,13 +174,12 @@ runprogram(char *progname,char** args, unsigned long nargs)
 	err = vfs_open(con, O_WRONLY, 0x660, &std);
 	if(err)
 		KASSERT("Initializing STDOUT failed");
-	fh = kmalloc(sizeof(struct filehandle));
+	fh = kmem_cache_alloc(g_fhcache);
 	if(fh==NULL)
 		KASSERT("Memory allocation for file handle failed");
 	fh->fileobject = std;
 	fh->offset = 0;
 	fh->open_mode = O_WRONLY;
-	fh->lk_fileaccess = lock_create("filelock");
 	fh->refcount = 0;
 	fh->isSeekable = 0;
 
@@ -191,13 +190,12 @@ runprogram(char *progname,char** args, unsigned long nargs)
 	err = vfs_open(con, O_WRONLY, 0660, &std);
 	if(err)
 		KASSERT("Initializing STDERR failed");
-	fh = kmalloc(sizeof(struct filehandle));
+	fh = kmem_cache_alloc(g_fhcache);
 	if(fh==NULL)
 		panic("Memory allocation for file handle failed");
 	fh->fileobject = std;
 	fh->offset = 0;
 	fh->open_mode = O_WRONLY;
-	fh->lk_fileaccess = lock_create("filelock");
 	fh->refcount = 0;
 	fh->isSeekable = 0;
 
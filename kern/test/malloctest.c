@@ -32,8 +32,10 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
+#include <vm.h>
 #include <test.h>
 
 /*
@@ -138,3 +140,111 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * kmalloc/kfree throughput against heap size.
+ *
+ * For each live-object count, allocate that many blocks of assorted
+ * sizes and keep them, then time BENCHOPS kmalloc/kfree pairs cycling
+ * through the same sizes, and BENCHOPS/8 pairs of whole-page
+ * allocations. With kfree doing a lookup rather than a walk of every
+ * heap page, neither figure should grow with the live count.
+ *
+ * Usage: km3 [live-count ...]
+ */
+
+#define BENCHOPS 20000
+
+static const size_t benchsizes[] = { 24, 48, 100, 200, 400, 1000, 2000 };
+#define NBENCHSIZES (sizeof(benchsizes)/sizeof(benchsizes[0]))
+
+static const unsigned benchlive[] = { 0, 250, 1000, 4000 };
+#define NBENCHLIVE (sizeof(benchlive)/sizeof(benchlive[0]))
+
+static
+uint64_t
+benchnsecs(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2)
+{
+	return (uint64_t)(s2 - s1) * 1000000000ULL + ns2 - ns1;
+}
+
+static
+void
+mallocbench_one(unsigned nlive)
+{
+	void **live;
+	void *ptr;
+	size_t bytes = 0;
+	time_t s1, s2;
+	uint32_t ns1, ns2;
+	uint64_t small, big;
+	unsigned i, n;
+
+	live = kmalloc((nlive ? nlive : 1) * sizeof(void *));
+	if (live == NULL) {
+		kprintf("km3: no memory for %u live pointers\n", nlive);
+		return;
+	}
+	for (n=0; n<nlive; n++) {
+		live[n] = kmalloc(benchsizes[n % NBENCHSIZES]);
+		if (live[n] == NULL) {
+			kprintf("km3: out of memory at %u live objects\n", n);
+			break;
+		}
+		bytes += benchsizes[n % NBENCHSIZES];
+	}
+
+	gettime(&s1, &ns1);
+	for (i=0; i<BENCHOPS; i++) {
+		ptr = kmalloc(benchsizes[i % NBENCHSIZES]);
+		if (ptr == NULL) {
+			panic("km3: kmalloc failed\n");
+		}
+		kfree(ptr);
+	}
+	gettime(&s2, &ns2);
+	small = benchnsecs(s1, ns1, s2, ns2);
+
+	gettime(&s1, &ns1);
+	for (i=0; i<BENCHOPS/8; i++) {
+		ptr = kmalloc(PAGE_SIZE);
+		if (ptr == NULL) {
+			panic("km3: kmalloc failed\n");
+		}
+		kfree(ptr);
+	}
+	gettime(&s2, &ns2);
+	big = benchnsecs(s1, ns1, s2, ns2);
+
+	kprintf("%6u live (%6luK): %6lu ns per pair, %6lu ns per page pair, "
+		"%lu pairs/sec\n", n, (unsigned long)(bytes / 1024),
+		(unsigned long)(small / BENCHOPS),
+		(unsigned long)(big / (BENCHOPS/8)),
+		(unsigned long)(BENCHOPS * 1000000000ULL / (small ? small : 1)));
+
+	for (i=0; i<n; i++) {
+		kfree(live[i]);
+	}
+	kfree(live);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	unsigned i;
+
+	kprintf("Starting kmalloc benchmark...\n");
+	if (nargs > 1) {
+		for (i=1; i<(unsigned)nargs; i++) {
+			mallocbench_one(atoi(args[i]));
+		}
+	}
+	else {
+		for (i=0; i<NBENCHLIVE; i++) {
+			mallocbench_one(benchlive[i]);
+		}
+	}
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
@@ -80,6 +80,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	bool kd_swap;		/* in use as raw swap space */
 };
 
 DECLARRAY(knowndev);
@@ -406,6 +407,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_swap = false;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -522,7 +524,7 @@ vfs_mount(const char *devname, void *data,
 		return result;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_swap) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -547,6 +549,46 @@ vfs_mount(const char *devname, void *data,
 	return 0;
 }
 
+/*
+ * Hand out a mountable device for use as swap space. DEVNAME may be
+ * either the device name or its raw name. The device must not have a
+ * filesystem on it, and can't be mounted afterwards.
+ */
+int
+vfs_swapon(const char *devname, struct device **result)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_rawname==NULL) {
+			/* not a disk */
+			continue;
+		}
+		if (strcmp(devname, kd->kd_name) &&
+		    strcmp(devname, kd->kd_rawname)) {
+			continue;
+		}
+
+		if (kd->kd_fs != NULL || kd->kd_swap) {
+			vfs_biglock_release();
+			return EBUSY;
+		}
+		KASSERT(kd->kd_device != NULL);
+		kd->kd_swap = true;
+		*result = kd->kd_device;
+		vfs_biglock_release();
+		return 0;
+	}
+
+	vfs_biglock_release();
+	return ENODEV;
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
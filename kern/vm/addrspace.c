@@ -36,6 +36,9 @@
 #include <current.h>
 #include <spl.h>
 #include <mips/tlb.h>
+#include <synch.h>
+#include <vnode.h>
+#include <kern/mman.h>
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -55,139 +58,205 @@ as_create(void)
 	for(int i=0;i<NUM_UBERPAGES;i++){
 		as->uberArray[i] = NULL;
 	}
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	for(int i=0;i<MAXCPUS;i++){
+		as->as_asid[i] = 0;
+	}
+	if (vm_hwpt_create(as)) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
 	as->tlbclock = 0;
+	as->as_swaphint = -1;
 	as->as_heapbase = 0;
 	as->as_heapend = 0;
+	as->as_sttop = 0;
 	as->segmentll = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
 	return as;
 }
 
+/*
+ * Copy one page of OLD into NEWAS: a resident page is shared
+ * copy-on-write, a page in swap is read into a frame of its own.
+ * Pages of shared memory are in the page cache, so sharing one just
+ * adds a reverse map entry.
+ */
+static
+int
+as_copy_page(struct addrspace *old, struct addrspace *newas, int i, int j)
+{
+	pte_t *oldpte;
+	pte_t *newpte;
+	bool resident;
+
+	if(newas->uberArray[i] == NULL)
+	{
+		int err = as_init_uberarray_section(newas, i);
+		if(err)
+			return err;
+	}
+	oldpte = &old->uberArray[i][j];
+	resident = pin_userpage(oldpte);	//waits out an eviction in progress
+
+	newpte = &newas->uberArray[i][j];
+	KASSERT(*newpte == VPAGE_UNINIT);
+	if(resident)
+	{
+		//share the frame; unless the region is shared, the first write to it makes a copy
+		index_t index = PTE_FRAME(*oldpte);
+		int err = share_userpage(index, newas, INDECES_TO_VADDR(i, j));
+		if(err == 0)
+			*newpte = VPAGE_INMEMORY | index;	//swap slot stays with old
+		unpin_userpage(index);
+		if(err)
+			return err;
+	}
+	else if((*oldpte & VPAGE_INSWAP) != 0)
+	{
+		index_t address;
+		int err= allocate_userpage(newas, i, j, false, &address);
+		if(err)
+			return err;
+		err = readfromswap(address, PTE_SLOT(*oldpte));
+		if(err)
+		{
+			free_userpage(address, newas);	//unpins it too; newpte stays unset
+			return err;
+		}
+		*newpte = VPAGE_INMEMORY | address;
+		unpin_userpage(address);
+	}
+	else
+	{
+		KASSERT((*oldpte & (VPAGE_INMEMORY|VPAGE_INSWAP)) == 0);
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
-	lock_acquire(g_swapper.lk_swapper);
+	struct segment *seg, **tail;
+	int err = 0;
+
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
-	//dumpcoremap();
-	//for(int i=0; i< 10000; i++)
-	//{
-//
-	//}
+	lock_acquire(old->as_lock);
 
-
-	for(int i=0; i<NUM_UBERPAGES; i++)
+	tail = &newas->segmentll;
+	for(seg = old->segmentll; seg != NULL; seg = seg->next)
 	{
-		if(old->uberArray[i] != NULL)
+		struct segment *copy = kmalloc(sizeof(struct segment));
+		if(copy == NULL)
 		{
-			if(newas->uberArray[i] == NULL)
-				as_init_uberarray_section(newas, i);
-			for(int j=0; j<NUM_SUBPAGES; j++)
-			{
-				if(old->uberArray[i][j] != NULL)
-				{
-					//allocate user page
-					KASSERT(newas->uberArray[i][j] == NULL);
-					newas->uberArray[i][j] = as_init_virtualpage();
-					//newas->uberArray[i][j]->swapfileoffset = old->uberArray[i][j]->swapfileoffset;
-					newas->uberArray[i][j]->permission = old->uberArray[i][j]->permission;
-					if( (old->uberArray[i][j]->status & VPAGE_INMEMORY) != 0 )
-					{
-						index_t address;
-						int err= allocate_userpage(newas, i, j, &address);
-						if(err)
-							return err;
-						memset((void *)PADDR_TO_KVADDR(address * PAGE_SIZE), 0, PAGE_SIZE );
-
-						newas->uberArray[i][j]->coremapindex = address;
-						copy_page(address, old->uberArray[i][j]->coremapindex);
-						newas->uberArray[i][j]->status = VPAGE_INMEMORY;
-					}
-					else if( ((old->uberArray[i][j]->status & VPAGE_INSWAP) != 0))
-					{
-						index_t address;
-						int err= allocate_userpage(newas, i, j, &address);
-						if(err)
-							return err;
-						memset((void *)PADDR_TO_KVADDR(address * PAGE_SIZE), 0, PAGE_SIZE );
-						newas->uberArray[i][j]->coremapindex = address;
-						readfromswap(address, old->uberArray[i][j]->swapfileoffset);
-						newas->uberArray[i][j]->status = VPAGE_INMEMORY;
-					}
-					else
-					{
-						if(old->uberArray[i][j]->status != 0)
-							KASSERT((old->uberArray[i][j]->status == 0));
-					}
+			lock_release(old->as_lock);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*copy = *seg;
+		copy->next = NULL;
+		if(copy->vn != NULL)
+			VOP_INCREF(copy->vn);
+		if(copy->anon != NULL)
+			vm_anon_incref(copy->anon);	//the child sees the same pages, faulting them in as it goes
+		*tail = copy;
+		tail = &copy->next;
+		if(seg == old->as_heap)
+			newas->as_heap = copy;
+		if(seg == old->as_stack)
+			newas->as_stack = copy;
+	}
 
-				}
-			}
+	//only the pages inside regions can exist
+	for(seg = old->segmentll; seg != NULL && err == 0; seg = seg->next)
+	{
+		vaddr_t vaddr = seg->startaddress & PAGE_FRAME;
+		for(int k = 0; k < seg->npages && err == 0; k++, vaddr += PAGE_SIZE)
+		{
+			int i = VADDR_TO_UBERINDEX(vaddr);
+			int j = VADDR_TO_SUBINDEX(vaddr);
+			if(old->uberArray[i] != NULL && old->uberArray[i][j] != VPAGE_UNINIT)
+				err = as_copy_page(old, newas, i, j);
 		}
 	}
+	if(err)
+	{
+		lock_release(old->as_lock);
+		as_destroy(newas);
+		return err;
+	}
 	newas->as_heapbase = old->as_heapbase;
 	newas->as_heapend = old->as_heapend;
 	newas->as_sttop = old->as_sttop;
 	*ret = newas;
-	newas->segmentll = NULL;
-	lock_release(g_swapper.lk_swapper);
+
+	/* old may still have writable TLB entries for frames that are now shared */
+	vm_asid_release(old);
+	as_activate(old);
+	lock_release(old->as_lock);
 	return 0;
 }
 
 void
 as_destroy(struct addrspace *as)
 {
-	for(int i = 0; i< NUM_UBERPAGES; i++)
+	struct segment *seg;
+
+	for(seg = as->segmentll; seg != NULL; seg = seg->next)
 	{
-		if(as->uberArray[i] != NULL)
+		if((seg->flags & SEG_SHARED) != 0 && seg->vn != NULL)
+			vm_syncfile(seg->vn);	//our writes reach the file even if we are the last mapper
+		vaddr_t vaddr = seg->startaddress & PAGE_FRAME;
+		for(int k = 0; k < seg->npages; k++, vaddr += PAGE_SIZE)
 		{
-			for(int j = 0; j < NUM_SUBPAGES; j++)
-			{
-				if(as->uberArray[i][j] != NULL)	//page exists free it
-				{
-					if( (as->uberArray[i][j]->status & VPAGE_INMEMORY) != 0)//there exists a frame corresponding to virtual page, free it
-					{
-						KASSERT(g_coremap.physicalpages[as->uberArray[i][j]->coremapindex].as == as);
-						free_userpage(as->uberArray[i][j]->coremapindex);
-					}
-					if((as->uberArray[i][j]->status & VPAGE_INSWAP) != 0)
-					{
-						//dosomething with the swapfile here
-					}
-					kfree(as->uberArray[i][j]);
-				}
-			}
-			kfree(as->uberArray[i]);
+			int i = VADDR_TO_UBERINDEX(vaddr);
+			int j = VADDR_TO_SUBINDEX(vaddr);
+			if(as->uberArray[i] != NULL && as->uberArray[i][j] != VPAGE_UNINIT)	//page exists free it
+				free_virtualpage(as, i, j);
 		}
 	}
+	for(int i = 0; i< NUM_UBERPAGES; i++)
+	{
+		if(as->uberArray[i] != NULL)
+			vm_pt_free(as->uberArray[i]);
+	}
 
 	struct segment *tmp;
 	for(tmp = as->segmentll; tmp!=NULL;)
 	{
 		struct segment *cur = tmp;
 		tmp = tmp ->next;
+		if(cur->vn != NULL)
+			VOP_DECREF(cur->vn);
+		if(cur->anon != NULL)
+			vm_anon_decref(cur->anon);
 		kfree(cur);
 	}
 
+	vm_asid_release(as);
+	vm_hwpt_destroy(as);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
+/*
+ * No TLB flush here: entries are tagged with the address space's ASID,
+ * so switching just changes which ones match.
+ */
 void
 as_activate(struct addrspace *as)
 {
-	int i, spl;
-
-	(void)as;
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-	//as->tlbclock = 0;
-	splx(spl);
+	vm_activate(as);
 }
 
 /*
@@ -200,61 +269,92 @@ as_activate(struct addrspace *as)
  * moment, these are ignored. When you write the VM system, you may
  * want to implement them.
  */
-int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		int readable, int writeable, int executable)
+static
+vaddr_t
+regionend(struct segment *seg)
 {
-	int uberindex = VADDR_TO_UBERINDEX(vaddr);
-	int subindex = VADDR_TO_SUBINDEX(vaddr);
-	int8_t permission = (readable) | (writeable) | (executable);
-
-	uint32_t bytesfromstart = (sz + (vaddr & 0xFFF));
-	uint32_t numpages = BYTES_TO_PAGES(bytesfromstart);	// vaddr & 0xFFF is necessary because loadelf may define region from middle of page so if we compute just with size we may not allocate enough
-	for(uint32_t i=0; i < numpages; i ++)
-	{
-		if(as->uberArray[uberindex] == NULL)
-		{
-			as_init_uberarray_section(as, uberindex);
-		}
+	return (seg->startaddress & PAGE_FRAME) + seg->npages * PAGE_SIZE;
+}
 
-		if(as->uberArray[uberindex][subindex] !=NULL)
-		{
-			return EFAULT;	//address already in use
-		}
-		as->uberArray[uberindex][subindex] = as_init_virtualpage();
-		as->uberArray[uberindex][subindex]->permission = (int8_t)0x2;
+/*
+ * Put a region of NPAGES pages from VADDR on AS's list, in address
+ * order. Fails if it overlaps one that is already there.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, uint32_t npages, int8_t permission, struct segment **ret)
+{
+	vaddr_t start = vaddr & PAGE_FRAME;
+	struct segment **prev = &as->segmentll;
 
-		subindex++;
-		if(subindex >= NUM_SUBPAGES)
-		{
-			subindex = 0;
-			uberindex++;
-		}
-	}
+	while(*prev != NULL && regionend(*prev) <= start)
+		prev = &(*prev)->next;
+	if(*prev != NULL && ((*prev)->startaddress & PAGE_FRAME) < start + npages * PAGE_SIZE)
+		return EFAULT;	//address already in use
 
 	struct segment *seg = kmalloc(sizeof(struct segment));
+	if(seg == NULL)
+		return ENOMEM;
+	seg->permission = permission;
 	seg->actualpermission = permission;
 	seg->startaddress = vaddr;
-	seg->next = NULL;
-	seg->npages = numpages;
+	seg->npages = npages;
+	seg->vn = NULL;
+	seg->anon = NULL;
+	seg->fileoffset = 0;
+	seg->filesize = 0;
+	seg->flags = 0;
+	seg->advice = MADV_NORMAL;
+	seg->next = *prev;
+	*prev = seg;
+	if(ret != NULL)
+		*ret = seg;
+	return 0;
+}
 
-	if(as->segmentll==NULL)
+/* The region VADDR is in, or NULL if it isn't a valid user address. */
+struct segment *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct segment *seg;
+
+	for(seg = as->segmentll; seg != NULL; seg = seg->next)
 	{
-		as->segmentll = seg;
+		if(vaddr < (seg->startaddress & PAGE_FRAME))
+			return NULL;	//sorted, so it's in none of them
+		if(vaddr < regionend(seg))
+			return seg;
 	}
-	else
-	{
-		struct segment* tmp;
-		for(tmp= as->segmentll; tmp->next !=NULL; tmp=tmp->next)
-		{
+	return NULL;
+}
 
-		}
-		tmp->next = seg;
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		int readable, int writeable, int executable,
+		struct vnode *v, off_t offset, size_t filesize)
+{
+	int8_t permission = (readable) | (writeable) | (executable);
+	struct segment *seg;
+	int err;
+
+	uint32_t bytesfromstart = (sz + (vaddr & 0xFFF));
+	uint32_t numpages = BYTES_TO_PAGES(bytesfromstart);	// vaddr & 0xFFF is necessary because loadelf may define region from middle of page so if we compute just with size we may not allocate enough
+
+	err = as_addregion(as, vaddr, numpages, permission, &seg);
+	if(err)
+		return err;
+	if(v != NULL && filesize > 0)
+	{
+		//paged in from the file as it is touched, see vm_fault
+		VOP_INCREF(v);
+		seg->vn = v;
+		seg->fileoffset = offset;
+		seg->filesize = filesize;
 	}
 
-	if(vaddr + sz > as->as_heapbase)
+	if(regionend(seg) > as->as_heapbase)
 	{
-		as->as_heapbase = INDECES_TO_VADDR(uberindex, subindex);
+		as->as_heapbase = regionend(seg);
 		as->as_heapend = as->as_heapbase;
 	}
 	return 0;
@@ -298,31 +398,28 @@ as_complete_load(struct addrspace *as)
 	struct segment *tmp;
 	for(tmp = as->segmentll; tmp!=NULL; tmp=tmp->next)
 	{
-		uint32_t uberindex = VADDR_TO_UBERINDEX(tmp->startaddress);
-		uint32_t subindex = VADDR_TO_SUBINDEX((tmp->startaddress));
-		for(int i=0;i< tmp->npages; i++)
-		{
-			as->uberArray[uberindex][subindex]->permission = tmp->actualpermission;
-			subindex++;
-			if(subindex == 1024)
-			{
-				subindex = 0;
-				uberindex++;
-			}
-		}
+		tmp->permission = tmp->actualpermission;
 	}
-	(void)as;
+
+	/* drop the writable translations used while loading */
+	vm_asid_release(as);
+	as_activate(as);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int err;
 
-	(void)as;
+	/* the heap starts out empty right after the last segment, sbrk grows it */
+	err = as_addregion(as, as->as_heapbase, 0, 0x6, &as->as_heap);
+	if(err)
+		return err;
+	/* the stack gets the top NUM_SUBPAGES pages */
+	err = as_addregion(as, INDECES_TO_VADDR(STACK_MAX, 0), NUM_SUBPAGES, 0x6, &as->as_stack);
+	if(err)
+		return err;
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -331,21 +428,198 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
-void as_init_uberarray_section(struct addrspace *as, int index)
+vaddr_t
+as_findhole(struct addrspace *as, uint32_t npages)
+{
+	vaddr_t found = 0;
+	struct segment *seg;
+
+	//the highest gap that fits, leaving the heap as much room as we can
+	for(seg = as->as_heap; seg != as->as_stack; seg = seg->next)
+	{
+		vaddr_t lo = regionend(seg);
+		vaddr_t hi = seg->next->startaddress & PAGE_FRAME;
+		if(hi - lo >= npages * PAGE_SIZE)
+			found = hi - npages * PAGE_SIZE;
+	}
+	return found;
+}
+
+int
+as_define_mapping(struct addrspace *as, vaddr_t vaddr, uint32_t npages,
+		int8_t permission, int8_t flags,
+		struct vnode *v, off_t offset, size_t filesize)
+{
+	struct segment *seg;
+	struct anonobj *anon = NULL;
+	int err;
+
+	if(v == NULL && (flags & SEG_SHARED) != 0)
+	{
+		//shared with children to come; its pages live in the object, not in any one process
+		anon = vm_anon_create(npages);
+		if(anon == NULL)
+			return ENOMEM;
+	}
+	err = as_addregion(as, vaddr, npages, permission, &seg);
+	if(err)
+	{
+		if(anon != NULL)
+			vm_anon_decref(anon);
+		return err;
+	}
+	seg->flags = flags | SEG_MMAP;
+	seg->anon = anon;
+	if(v != NULL)
+	{
+		//paged in (and, if shared, written back) as it is touched, see vm_fault
+		VOP_INCREF(v);
+		seg->vn = v;
+		seg->fileoffset = offset;
+		seg->filesize = filesize;
+	}
+	return 0;
+}
+
+/* Drop the first NPAGES pages of a mapping. */
+static
+void
+as_trimfront(struct segment *seg, uint32_t npages)
+{
+	size_t skip = npages * PAGE_SIZE;
+
+	seg->startaddress += skip;
+	seg->npages -= npages;
+	seg->fileoffset += skip;
+	seg->filesize = seg->filesize > skip ? seg->filesize - skip : 0;
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, uint32_t npages)
+{
+	vaddr_t end = vaddr + npages * PAGE_SIZE;
+	struct segment **prev = &as->segmentll;
+	struct segment *spare;
+
+	//in case we have to split a mapping in two; before anything is gone
+	spare = kmalloc(sizeof(struct segment));
+	if(spare == NULL)
+		return ENOMEM;
+
+	while(*prev != NULL && (*prev)->startaddress < end)
+	{
+		struct segment *seg = *prev;
+		vaddr_t lo = seg->startaddress > vaddr ? seg->startaddress : vaddr;
+		vaddr_t hi = regionend(seg) < end ? regionend(seg) : end;
+
+		if(lo >= hi || (seg->flags & SEG_MMAP) == 0)
+		{
+			prev = &seg->next;
+			continue;
+		}
+		if((seg->flags & SEG_SHARED) != 0 && seg->vn != NULL)
+			vm_syncfile(seg->vn);
+		vm_unmap(as, lo, (hi - lo) / PAGE_SIZE);
+
+		if(lo == seg->startaddress && hi == regionend(seg))
+		{
+			//all of it
+			*prev = seg->next;
+			if(seg->vn != NULL)
+				VOP_DECREF(seg->vn);
+			if(seg->anon != NULL)
+				vm_anon_decref(seg->anon);
+			kfree(seg);
+			continue;
+		}
+		if(lo == seg->startaddress)
+		{
+			as_trimfront(seg, (hi - lo) / PAGE_SIZE);
+		}
+		else if(hi == regionend(seg))
+		{
+			seg->npages = (lo - seg->startaddress) / PAGE_SIZE;
+		}
+		else
+		{
+			//a hole in the middle: the part above it becomes a mapping of its own
+			KASSERT(spare != NULL);
+			*spare = *seg;
+			as_trimfront(spare, (hi - seg->startaddress) / PAGE_SIZE);
+			if(spare->vn != NULL)
+				VOP_INCREF(spare->vn);
+			if(spare->anon != NULL)
+				vm_anon_incref(spare->anon);
+			seg->npages = (lo - seg->startaddress) / PAGE_SIZE;
+			seg->next = spare;
+			spare = NULL;
+		}
+		prev = &seg->next;
+	}
+	if(spare != NULL)
+		kfree(spare);
+	return 0;
+}
+
+int
+as_advise(struct addrspace *as, vaddr_t vaddr, uint32_t npages, int advice)
 {
-	as->uberArray[index] =  (struct virtualpage **)kmalloc(NUM_SUBPAGES * sizeof(struct virtualpage*));
-	for(int i=0;i < NUM_SUBPAGES; i++)
+	vaddr_t end = vaddr + npages * PAGE_SIZE;
+	vaddr_t covered = vaddr;	//how far the regions reach without a gap
+	struct segment *seg;
+	int err = 0;
+
+	if(advice == MADV_DONTNEED)
+	{
+		//shared anonymous pages belong to their object and the other sharers, not to us, so there's nothing to throw away; refuse before touching anything
+		for(seg = as->segmentll; seg != NULL && (seg->startaddress & PAGE_FRAME) < end; seg = seg->next)
+		{
+			if(regionend(seg) > vaddr && (seg->flags & SEG_SHARED) != 0 && seg->vn == NULL)
+				return EINVAL;
+		}
+	}
+	for(seg = as->segmentll; seg != NULL && (seg->startaddress & PAGE_FRAME) < end && err == 0; seg = seg->next)
 	{
-		as->uberArray[index][i] = NULL;
+		vaddr_t lo = (seg->startaddress & PAGE_FRAME) > vaddr ? (seg->startaddress & PAGE_FRAME) : vaddr;
+		vaddr_t hi = regionend(seg) < end ? regionend(seg) : end;
+
+		if(lo >= hi)
+			continue;
+		if(lo == covered)
+			covered = hi;
+		switch(advice)
+		{
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			seg->advice = advice;	//the whole region, they aren't split for this
+			break;
+		case MADV_WILLNEED:
+			if((seg->permission & 0x4) == 0)
+				break;	//it couldn't be read anyway
+			if(seg == as->as_heap && hi > ((as->as_heapend + PAGE_SIZE - 1) & PAGE_FRAME))
+				hi = (as->as_heapend + PAGE_SIZE - 1) & PAGE_FRAME;	//nothing past the break
+			for(vaddr_t page = lo; page < hi && err == 0; page += PAGE_SIZE)
+				err = vm_willneed(as, page);
+			break;
+		case MADV_DONTNEED:
+			if((seg->flags & SEG_SHARED) != 0 && seg->vn != NULL)
+				vm_syncfile(seg->vn);	//the file keeps what was written
+			g_coremap.ndontneed += vm_unmap(as, lo, (hi - lo) / PAGE_SIZE);
+			break;
+		default:
+			return EINVAL;
+		}
 	}
+	if(err)
+		return err;
+	return covered < end ? ENOMEM : 0;	//part of the range isn't mapped
 }
 
-struct virtualpage* as_init_virtualpage()
+int as_init_uberarray_section(struct addrspace *as, int index)
 {
-	struct virtualpage *page = kmalloc(sizeof(struct virtualpage));
-	page->coremapindex = 0;
-	page->swapfileoffset = 0;
-	page->permission = 0;
-	page->status = VPAGE_UNINIT;
-	return page;
+	as->uberArray[index] = vm_pt_alloc();	//comes back all VPAGE_UNINIT
+	if(as->uberArray[index] == NULL)
+		return ENOMEM;
+	return 0;
 }
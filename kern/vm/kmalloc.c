@@ -30,7 +30,15 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmemcache.h>
+#include "opt-kmallocprof.h"
+#if OPT_KMALLOCPROF
+#include <kmprof.h>
+#endif
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -118,51 +126,93 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Pagerefs come a page-sized chunk at a time: a chunk holds
+ * NPAGEREFS of them and a bitmap of which are in use, and manages
+ * about 1M of kernel heap. The first chunk is in the kernel BSS, so
+ * kmalloc works before the VM system does; when it fills up, more
+ * chunks are chained on with alloc_kpages. A chunk is never given
+ * back; it costs one page per 250-odd pages of heap at most.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Bits in the last bitmap word past NPAGEREFS are set at the start
+ * and stay set, so the search never hands them out.
+ */
+
+#define NPAGEREFS ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define INUSE_WORDS ((NPAGEREFS + 31)/32)
+#define INUSE_PAD \
+	(NPAGEREFS % 32 == 0 ? 0 : ~((((uint32_t)1) << (NPAGEREFS % 32)) - 1))
+
+struct pagerefchunk {
+	struct pagerefchunk *next;
+	unsigned nused;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
+
+static struct pagerefchunk firstchunk = {
+	.inuse = { [INUSE_WORDS-1] = INUSE_PAD },
+};
+static struct pagerefchunk *pagerefchunks = &firstchunk;
+static unsigned npagerefchunks = 1;
+static unsigned npagerefsused;
+
+/*
+ * Chain on the page at CHUNKADDR as a new, empty chunk.
  */
+static
+void
+addpagerefchunk(vaddr_t chunkaddr)
+{
+	struct pagerefchunk *chunk;
+	unsigned i;
+
+	COMPILE_ASSERT(sizeof(struct pagerefchunk) <= PAGE_SIZE);
+	KASSERT(chunkaddr % PAGE_SIZE == 0);
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+	chunk = (struct pagerefchunk *)chunkaddr;
+	chunk->nused = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		chunk->inuse[i] = 0;
+	}
+	chunk->inuse[INUSE_WORDS-1] = INUSE_PAD;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	chunk->next = pagerefchunks;
+	pagerefchunks = chunk;
+	npagerefchunks++;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct pagerefchunk *chunk;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	for (chunk = pagerefchunks; chunk != NULL; chunk = chunk->next) {
+		if (chunk->nused == NPAGEREFS) {
 			/* full */
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (chunk->inuse[i]==0xffffffff) {
+				/* full */
+				continue;
+			}
+			for (k=1,j=0; k!=0; k<<=1,j++) {
+				if ((chunk->inuse[i] & k)==0) {
+					chunk->inuse[i] |= k;
+					chunk->nused++;
+					npagerefsused++;
+					return &chunk->refs[i*32 + j];
+				}
 			}
+			KASSERT(0);
 		}
 		KASSERT(0);
 	}
 
-	/* ran out */
+	/* ran out; caller adds a chunk */
 	return NULL;
 }
 
@@ -170,15 +220,27 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefchunk *chunk;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
+	/* every chunk but the first is a page of its own */
+	if (p >= firstchunk.refs && p < firstchunk.refs + NPAGEREFS) {
+		chunk = &firstchunk;
+	}
+	else {
+		chunk = (struct pagerefchunk *)((vaddr_t)p & PAGE_FRAME);
+	}
+
+	j = p-chunk->refs;
 	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((chunk->inuse[i] & k) != 0);
+	chunk->inuse[i] &= ~k;
+	KASSERT(chunk->nused > 0);
+	chunk->nused--;
+	npagerefsused--;
 }
 
 ////////////////////////////////////////
@@ -186,17 +248,65 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Set by kheap_bootstrap once every subpage page has its pageref
+ * recorded as its owner (vm_setkmowner). From then on a page without
+ * an owner isn't one of ours, and kfree never walks allbase.
+ */
+static bool kheap_owned;
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the page lists. The per-cpu magazines below
+ * keep most kmalloc/kfree calls from ever taking it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps a small stack (a magazine) of free blocks of each
+//    size. kmalloc pops from it and kfree pushes onto it under the
+//    cpu's own spinlock, so the common alloc/free pair never touches
+//    kmalloc_spinlock. An empty magazine is refilled with MAG_BATCH
+//    blocks from the page freelists in one trip to the global lock,
+//    and a full one sends its MAG_BATCH oldest blocks back the same
+//    way.
+//
+//    Blocks sitting in magazines still count as allocated as far as
+//    their pages go, so such a page is never released. When a fresh
+//    page can't be had, every magazine is drained before giving up.
+//
+//    kfree can only use a magazine if it can learn the block's size
+//    without the global lock, which it does with vm_getkmowner. Until
+//    kheap_bootstrap pages have no owner, and blocks are freed the
+//    slow way.
+//
+//    Lock order: a cpu's magazine lock, then kmalloc_spinlock.
+//
+
+#define MAG_SIZE	16	/* blocks a magazine holds */
+#define MAG_BATCH	8	/* blocks moved to or from the page lists at once */
+
+struct magazine {
+	unsigned nblocks;
+	void *blocks[MAG_SIZE];
+};
+
+struct kmcpu {
+	struct spinlock lock;
+	struct magazine mags[NSIZES];
+	unsigned nhits;		/* calls served from the magazine alone */
+	unsigned nrefills;	/* trips to the page lists for blocks */
+	unsigned ndrains;	/* trips to the page lists with blocks */
+};
+
+/* all zeros is an unheld spinlock, so these need no setup */
+static struct kmcpu kmcpus[MAXCPUS];
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -260,14 +370,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefsused);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefsused);
 		ac++;
 	}
 
@@ -330,10 +440,30 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Give every subpage page we have so far its owner. Called once by
+ * the VM system as soon as it can record them; pages made after that
+ * get theirs as they're made.
+ */
+void
+kheap_bootstrap(void)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		vm_setkmowner(PR_PAGEADDR(pr), pr);
+	}
+	kheap_owned = true;
+	spinlock_release(&kmalloc_spinlock);
+}
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmcpu *kc;
+	unsigned c, b;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,7 +474,30 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	kprintf("pagerefs: %u of %u in use, %u chunk%s "
+		"(room for %luK of heap)\n", npagerefsused,
+		npagerefchunks * (unsigned) NPAGEREFS, npagerefchunks,
+		npagerefchunks == 1 ? "" : "s",
+		(unsigned long) (npagerefchunks * NPAGEREFS * PAGE_SIZE / 1024));
+
 	spinlock_release(&kmalloc_spinlock);
+
+	/* blocks shown as allocated above may be parked here */
+	for (c=0; c<MAXCPUS; c++) {
+		kc = &kmcpus[c];
+		spinlock_acquire(&kc->lock);
+		if (kc->nhits + kc->nrefills + kc->ndrains > 0) {
+			kprintf("cpu%u magazines: %u hits, %u refills, "
+				"%u drains; holding", c, kc->nhits,
+				kc->nrefills, kc->ndrains);
+			for (b=0; b<NSIZES; b++) {
+				kprintf(" %lu:%u", (unsigned long) sizes[b],
+					kc->mags[b].nblocks);
+			}
+			kprintf("\n");
+		}
+		spinlock_release(&kc->lock);
+	}
 }
 
 ////////////////////////////////////////
@@ -392,6 +545,285 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of PR, which must have one.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		if(pr->nfree != 0)
+			panic("help");
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put the block PTR back on the freelist of PR, its page. Returns
+ * true if that leaves the whole page free; in that case the page has
+ * been taken off the lists and its pageref released, and the caller
+ * must free_kpages it once it has dropped kmalloc_spinlock.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
+	KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		vm_setkmowner(prpage, NULL);
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find the pageref of the page holding PTRADDR, or NULL if it isn't
+ * a subpage page. Once pages have owners this is a lookup in the
+ * coremap; before that, a walk of allbase.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr = vm_getkmowner(ptraddr & PAGE_FRAME);
+	if (pr != NULL) {
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+		return pr;
+	}
+	if (kheap_owned) {
+		return NULL;
+	}
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+			break;
+		}
+	}
+	return pr;
+}
+
+////////////////////////////////////////
+
+/*
+ * Send the oldest N blocks in MAG back to their pages. Called with the
+ * magazine's cpu lock held. Pages this leaves wholly free are put in
+ * FREED, for the caller to free_kpages after letting go of the lock;
+ * returns how many.
+ */
+static
+unsigned
+mag_drain(struct magazine *mag, unsigned n, vaddr_t *freed)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	unsigned i, nfreed = 0;
+
+	KASSERT(n <= mag->nblocks);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		pr = subpage_findpage((vaddr_t)mag->blocks[i]);
+		KASSERT(pr != NULL);
+		prpage = PR_PAGEADDR(pr);
+		if (subpage_putblock(pr, mag->blocks[i])) {
+			freed[nfreed++] = prpage;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=n; i<mag->nblocks; i++) {
+		mag->blocks[i-n] = mag->blocks[i];
+	}
+	mag->nblocks -= n;
+	return nfreed;
+}
+
+/*
+ * Get a block of size class BLKTYPE from this cpu's magazine, filling
+ * it from the page lists if it's empty. Returns NULL if there isn't a
+ * cpu to have magazines yet, or no page has a free block of the size.
+ */
+static
+void *
+mag_alloc(int blktype)
+{
+	struct kmcpu *kc;
+	struct magazine *mag;
+	struct pageref *pr;
+	void *ptr;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* If we migrate before locking, we just use that cpu's instead. */
+	kc = &kmcpus[curcpu->c_number];
+	mag = &kc->mags[blktype];
+
+	spinlock_acquire(&kc->lock);
+	if (mag->nblocks > 0) {
+		kc->nhits++;
+	}
+	else {
+		kc->nrefills++;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[blktype];
+		     pr != NULL && mag->nblocks < MAG_BATCH;
+		     pr = pr->next_samesize) {
+			KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+			while (pr->nfree > 0 && mag->nblocks < MAG_BATCH) {
+				mag->blocks[mag->nblocks++] =
+					subpage_takeblock(pr);
+			}
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+
+		if (mag->nblocks == 0) {
+			spinlock_release(&kc->lock);
+			return NULL;
+		}
+	}
+	ptr = mag->blocks[--mag->nblocks];
+	spinlock_release(&kc->lock);
+
+	return ptr;
+}
+
+/*
+ * Put PTR, a block of size class BLKTYPE, in this cpu's magazine,
+ * first making room if it's full.
+ */
+static
+void
+mag_free(void *ptr, int blktype)
+{
+	struct kmcpu *kc;
+	struct magazine *mag;
+	vaddr_t freed[MAG_BATCH];
+	unsigned i, nfreed = 0;
+
+	KASSERT(CURCPU_EXISTS());
+	kc = &kmcpus[curcpu->c_number];
+	mag = &kc->mags[blktype];
+
+	spinlock_acquire(&kc->lock);
+	if (mag->nblocks < MAG_SIZE) {
+		kc->nhits++;
+	}
+	else {
+		kc->ndrains++;
+		nfreed = mag_drain(mag, MAG_BATCH, freed);
+	}
+	mag->blocks[mag->nblocks++] = ptr;
+	spinlock_release(&kc->lock);
+
+	/* Call free_kpages without any of our locks. */
+	for (i=0; i<nfreed; i++) {
+		free_kpages(freed[i]);
+	}
+}
+
+/*
+ * Empty every cpu's magazines back onto the page lists, so wholly
+ * free pages can go back to the VM system. Returns how many blocks
+ * were drained.
+ */
+static
+unsigned
+mag_drainall(void)
+{
+	struct kmcpu *kc;
+	vaddr_t freed[MAG_SIZE];
+	unsigned c, b, i, n, nfreed, total = 0;
+
+	for (c=0; c<MAXCPUS; c++) {
+		kc = &kmcpus[c];
+		for (b=0; b<NSIZES; b++) {
+			spinlock_acquire(&kc->lock);
+			n = kc->mags[b].nblocks;
+			nfreed = mag_drain(&kc->mags[b], n, freed);
+			spinlock_release(&kc->lock);
+
+			for (i=0; i<nfreed; i++) {
+				free_kpages(freed[i]);
+			}
+			total += n;
+		}
+	}
+	return total;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -402,6 +834,8 @@ subpage_kmalloc(size_t sz)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+	bool drained = false;	// emptied the magazines already
+	vaddr_t chunkaddr;	// page for more pagerefs
 
 	volatile int i;
 
@@ -409,6 +843,12 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
+	retptr = mag_alloc(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+
+ retry:
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -423,27 +863,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				if(pr->nfree != 0)
-					panic("help");
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 
 			checksubpages();
 
@@ -464,6 +884,13 @@ subpage_kmalloc(size_t sz)
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
+		if (!drained) {
+			/* Blocks parked in magazines may free some pages. */
+			drained = true;
+			if (mag_drainall() > 0) {
+				goto retry;
+			}
+		}
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
@@ -472,11 +899,23 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/*
+		 * Out of pagerefs; get a page for another chunk of them,
+		 * again without the spinlock. Someone else may have added
+		 * one meanwhile, in which case we just have a spare.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		chunkaddr = alloc_kpages(1);
+		if (chunkaddr==0) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefchunk(chunkaddr);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -506,6 +945,8 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	vm_setkmowner(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -518,35 +959,47 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
+	/*
+	 * Fast path: if the page has an owner we know the block size
+	 * without the lock (the page can't go away while ptr is live),
+	 * and the block goes in this cpu's magazine. If it has none and
+	 * every subpage page has one, it's a big allocation.
+	 */
+	pr = vm_getkmowner(ptraddr & PAGE_FRAME);
+	if (pr == NULL && kheap_owned) {
+		return -1;
+	}
+	if (pr != NULL && CURCPU_EXISTS()) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
 		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		offset = ptraddr - prpage;
+		if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
 		}
+		fill_deadbeef(ptr, sizes[blktype]);
+		mag_free(ptr, blktype);
+		return 0;
 	}
 
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	pr = subpage_findpage(ptraddr);
+
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -560,26 +1013,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_putblock(pr, ptr)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -600,8 +1034,9 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_once(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -620,6 +1055,24 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	ptr = kmalloc_once(sz);
+	if (ptr == NULL && kmem_cache_reap() > 0) {
+		/* The object caches gave some memory back; try again. */
+		ptr = kmalloc_once(sz);
+	}
+#if OPT_KMALLOCPROF
+	if (ptr != NULL) {
+		kmprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+#endif
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
@@ -628,7 +1081,12 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_KMALLOCPROF
+	/* Before the block can be handed out again. */
+	kmprof_free(ptr);
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
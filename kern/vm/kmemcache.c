@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmemcache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmemcache.h>
+
+#define KMEM_DEFAULT_MAXFREE 16
+#define KMEM_REAP_BATCH      16	/* objects taken per trip in reap */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	unsigned kc_maxfree;
+	unsigned kc_nfree;
+	void **kc_free;			/* constructed objects on hand */
+
+	/* statistics, under kc_lock */
+	unsigned kc_nlive;		/* objects allocated right now */
+	unsigned kc_nallocs;		/* kmem_cache_alloc calls */
+	unsigned kc_nhits;		/* ...served from kc_free */
+	unsigned kc_nctors;		/* constructor runs */
+	unsigned kc_ndtors;		/* destructor runs */
+
+	unsigned kc_reapgen;		/* last reap that emptied it */
+	struct kmem_cache *kc_next;	/* on allcaches */
+};
+
+/*
+ * All caches, for reaping and statistics. Lock order: the list lock,
+ * then a cache's lock.
+ */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+static unsigned reapgen;		/* under allcaches_lock */
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, unsigned maxfree,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+	if (maxfree == 0) {
+		maxfree = KMEM_DEFAULT_MAXFREE;
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_free = kmalloc(maxfree * sizeof(void *));
+	if (kc->kc_free == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_maxfree = maxfree;
+	kc->kc_nfree = 0;
+	kc->kc_nlive = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nhits = 0;
+	kc->kc_nctors = 0;
+	kc->kc_ndtors = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	kc->kc_reapgen = reapgen;
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	spinlock_release(&allcaches_lock);
+
+	return kc;
+}
+
+/*
+ * Run the destructor on OBJ and give its memory back.
+ */
+static
+void
+kmem_cache_discard(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Destroy every object on KC's free list; returns how many. The list
+ * is emptied one object at a time so the destructor and kfree run
+ * without kc_lock.
+ */
+static
+unsigned
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *obj;
+	unsigned n = 0;
+
+	for (;;) {
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_nfree == 0) {
+			spinlock_release(&kc->kc_lock);
+			break;
+		}
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_ndtors++;
+		spinlock_release(&kc->kc_lock);
+
+		kmem_cache_discard(kc, obj);
+		n++;
+	}
+	return n;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	spinlock_acquire(&allcaches_lock);
+	for (p = &allcaches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&allcaches_lock);
+
+	kmem_cache_drain(kc);
+	KASSERT(kc->kc_nlive == 0);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_free);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_nallocs++;
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_nhits++;
+		kc->kc_nlive++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Nothing on hand; make a new one. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_nctors++;
+	kc->kc_nlive++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_nlive > 0);
+	kc->kc_nlive--;
+	if (kc->kc_nfree < kc->kc_maxfree) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_ndtors++;
+	spinlock_release(&kc->kc_lock);
+
+	/* Enough on hand already. */
+	kmem_cache_discard(kc, obj);
+}
+
+/*
+ * Objects are taken off the free lists a batch at a time under the
+ * locks, and destroyed after both are dropped, so destructors run
+ * holding nothing of ours. Since the list can change while we're not
+ * holding it, each trip starts again from the head and takes the first
+ * cache this reap hasn't emptied yet; a cache counts as emptied once
+ * it has been seen with nothing left, so this finishes even if objects
+ * are freed into caches behind us.
+ */
+unsigned
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	void *objs[KMEM_REAP_BATCH];
+	void (*dtor)(void *obj);
+	unsigned gen, nobjs, i;
+	unsigned n = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	gen = ++reapgen;
+	spinlock_release(&allcaches_lock);
+
+	for (;;) {
+		spinlock_acquire(&allcaches_lock);
+		for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+			if (kc->kc_reapgen != gen) {
+				break;
+			}
+		}
+		if (kc == NULL) {
+			spinlock_release(&allcaches_lock);
+			break;
+		}
+
+		spinlock_acquire(&kc->kc_lock);
+		nobjs = 0;
+		while (kc->kc_nfree > 0 && nobjs < KMEM_REAP_BATCH) {
+			objs[nobjs++] = kc->kc_free[--kc->kc_nfree];
+		}
+		if (kc->kc_nfree == 0) {
+			kc->kc_reapgen = gen;
+		}
+		kc->kc_ndtors += nobjs;
+		/* kc itself may be destroyed once we let go */
+		dtor = kc->kc_dtor;
+		spinlock_release(&kc->kc_lock);
+		spinlock_release(&allcaches_lock);
+
+		for (i = 0; i < nobjs; i++) {
+			if (dtor != NULL) {
+				dtor(objs[i]);
+			}
+			kfree(objs[i]);
+		}
+		n += nobjs;
+	}
+
+	return n;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned pct;
+
+	spinlock_acquire(&allcaches_lock);
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %5s %5s %5s %8s %4s %6s %6s\n", "name", "size",
+		"live", "free", "allocs", "hit", "ctors", "dtors");
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		pct = kc->kc_nallocs == 0 ? 0 :
+			(unsigned)((uint64_t)kc->kc_nhits * 100 /
+				   kc->kc_nallocs);
+		kprintf("  %-12s %5lu %5u %5u %8u %3u%% %6u %6u\n",
+			kc->kc_name, (unsigned long) kc->kc_size,
+			kc->kc_nlive, kc->kc_nfree, kc->kc_nallocs, pct,
+			kc->kc_nctors, kc->kc_ndtors);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&allcaches_lock);
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * kmalloc profiler. See kmprof.h.
+ *
+ * Everything lives in static tables so that recording an allocation
+ * never calls back into kmalloc. Live blocks are kept in a hash table
+ * chained through 16-bit indexes (0 is the null index), twelve bytes
+ * per block; call sites are found through a small open-addressed
+ * hash, and are never removed.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmprof.h>
+
+#define KMPROF_MAXLIVE   8192		/* blocks tracked at once */
+#define KMPROF_HASHBITS  12
+#define KMPROF_NHASH     (1 << KMPROF_HASHBITS)
+#define KMPROF_MAXSITES  256
+#define KMPROF_SITEHASH  (2 * KMPROF_MAXSITES)
+
+struct kmprof_block {
+	vaddr_t kb_ptr;
+	uint32_t kb_size;
+	uint16_t kb_site;		/* index into sites[] */
+	uint16_t kb_next;		/* hash chain or free list */
+};
+
+struct kmprof_site {
+	vaddr_t ks_caller;		/* 0 for the overflow site */
+	unsigned ks_nlive;
+	size_t ks_livebytes;
+	unsigned ks_nallocs;		/* ever */
+	unsigned ks_snapnlive;		/* at the last kmprof_snapshot */
+	size_t ks_snaplivebytes;
+};
+
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+
+/* blocks[0] is unused so that index 0 can mean "none". */
+static struct kmprof_block blocks[KMPROF_MAXLIVE + 1];
+static uint16_t blockhash[KMPROF_NHASH];
+static uint16_t blockfree;		/* head of the free list */
+static unsigned blocksused;		/* high water mark in blocks[] */
+static unsigned nuntracked;		/* allocations the table had no room for */
+
+/*
+ * sites[0] soaks up call sites that arrive after the table is full.
+ * sitehash holds index+1, 0 meaning empty.
+ */
+static struct kmprof_site sites[KMPROF_MAXSITES];
+static uint16_t sitehash[KMPROF_SITEHASH];
+static unsigned nsites = 1;
+
+static
+unsigned
+kmprof_hashptr(vaddr_t ptr)
+{
+	/* Blocks are at least 16 bytes, so the low bits carry nothing. */
+	return ((ptr >> 4) * 2654435761U) >> (32 - KMPROF_HASHBITS);
+}
+
+static
+unsigned
+kmprof_findsite(vaddr_t caller)
+{
+	unsigned h, i;
+
+	h = ((caller >> 2) * 2654435761U) % KMPROF_SITEHASH;
+	for (i = 0; i < KMPROF_SITEHASH; i++) {
+		unsigned slot = (h + i) % KMPROF_SITEHASH;
+
+		if (sitehash[slot] == 0) {
+			if (nsites == KMPROF_MAXSITES) {
+				return 0;
+			}
+			sites[nsites].ks_caller = caller;
+			sitehash[slot] = nsites + 1;
+			return nsites++;
+		}
+		if (sites[sitehash[slot] - 1].ks_caller == caller) {
+			return sitehash[slot] - 1;
+		}
+	}
+	return 0;
+}
+
+void
+kmprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct kmprof_block *kb;
+	struct kmprof_site *ks;
+	unsigned ix, h;
+
+	spinlock_acquire(&kmprof_lock);
+
+	if (blockfree != 0) {
+		ix = blockfree;
+		blockfree = blocks[ix].kb_next;
+	}
+	else if (blocksused < KMPROF_MAXLIVE) {
+		ix = ++blocksused;
+	}
+	else {
+		nuntracked++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	ks = &sites[kmprof_findsite(caller)];
+	ks->ks_nlive++;
+	ks->ks_livebytes += sz;
+	ks->ks_nallocs++;
+
+	kb = &blocks[ix];
+	kb->kb_ptr = (vaddr_t)ptr;
+	kb->kb_size = sz;
+	kb->kb_site = ks - sites;
+	h = kmprof_hashptr(kb->kb_ptr);
+	kb->kb_next = blockhash[h];
+	blockhash[h] = ix;
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_block *kb;
+	struct kmprof_site *ks;
+	uint16_t *p, ix;
+
+	spinlock_acquire(&kmprof_lock);
+
+	for (p = &blockhash[kmprof_hashptr((vaddr_t)ptr)]; *p != 0;
+	     p = &blocks[*p].kb_next) {
+		kb = &blocks[*p];
+		if (kb->kb_ptr == (vaddr_t)ptr) {
+			ks = &sites[kb->kb_site];
+			KASSERT(ks->ks_nlive > 0);
+			ks->ks_nlive--;
+			ks->ks_livebytes -= kb->kb_size;
+
+			ix = *p;
+			*p = kb->kb_next;
+			kb->kb_next = blockfree;
+			blockfree = ix;
+			break;
+		}
+	}
+	/* If it wasn't found, it was one of the untracked ones. */
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_snapshot(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&kmprof_lock);
+	for (i = 0; i < nsites; i++) {
+		sites[i].ks_snapnlive = sites[i].ks_nlive;
+		sites[i].ks_snaplivebytes = sites[i].ks_livebytes;
+	}
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * The report is copied out under the lock and printed afterwards.
+ * Only the menu thread calls this, so one static copy will do.
+ */
+static struct kmprof_site report[KMPROF_MAXSITES];
+
+void
+kmprof_report(bool diff)
+{
+	struct kmprof_site tmp;
+	unsigned i, j, n, untracked;
+	int dbytes, dlive;
+	size_t totbytes = 0;
+	unsigned totlive = 0;
+	int dtotbytes = 0, dtotlive = 0;
+
+	spinlock_acquire(&kmprof_lock);
+	n = nsites;
+	memcpy(report, sites, n * sizeof(report[0]));
+	untracked = nuntracked;
+	spinlock_release(&kmprof_lock);
+
+	/* Insertion sort, biggest live (or changed) byte count first. */
+	for (i = 1; i < n; i++) {
+		tmp = report[i];
+		dbytes = diff ? (int)(tmp.ks_livebytes - tmp.ks_snaplivebytes)
+			: (int)tmp.ks_livebytes;
+		for (j = i; j > 0; j--) {
+			int other = diff ?
+				(int)(report[j-1].ks_livebytes -
+				      report[j-1].ks_snaplivebytes)
+				: (int)report[j-1].ks_livebytes;
+			if (other >= dbytes) {
+				break;
+			}
+			report[j] = report[j-1];
+		}
+		report[j] = tmp;
+	}
+
+	if (diff) {
+		kprintf("kmalloc call sites changed since snapshot:\n");
+		kprintf("  %-10s %10s %8s\n", "caller", "bytes", "blocks");
+	}
+	else {
+		kprintf("kmalloc live memory by call site:\n");
+		kprintf("  %-10s %10s %8s %10s\n", "caller", "bytes",
+			"blocks", "allocs");
+	}
+	for (i = 0; i < n; i++) {
+		struct kmprof_site *ks = &report[i];
+
+		if (ks->ks_nallocs == 0) {
+			continue;
+		}
+		if (diff) {
+			dbytes = ks->ks_livebytes - ks->ks_snaplivebytes;
+			dlive = ks->ks_nlive - ks->ks_snapnlive;
+			if (dbytes == 0 && dlive == 0) {
+				continue;
+			}
+			dtotbytes += dbytes;
+			dtotlive += dlive;
+			if (ks->ks_caller == 0) {
+				kprintf("  %-10s %10d %8d\n", "(other)",
+					dbytes, dlive);
+			}
+			else {
+				kprintf("  0x%08lx %10d %8d\n",
+					(unsigned long)ks->ks_caller,
+					dbytes, dlive);
+			}
+		}
+		else {
+			if (ks->ks_nlive == 0) {
+				continue;
+			}
+			totbytes += ks->ks_livebytes;
+			totlive += ks->ks_nlive;
+			if (ks->ks_caller == 0) {
+				kprintf("  %-10s %10lu %8u %10u\n", "(other)",
+					(unsigned long)ks->ks_livebytes,
+					ks->ks_nlive, ks->ks_nallocs);
+			}
+			else {
+				kprintf("  0x%08lx %10lu %8u %10u\n",
+					(unsigned long)ks->ks_caller,
+					(unsigned long)ks->ks_livebytes,
+					ks->ks_nlive, ks->ks_nallocs);
+			}
+		}
+	}
+	if (diff) {
+		kprintf("  %-10s %10d %8d\n", "total", dtotbytes,
+			dtotlive);
+	}
+	else {
+		kprintf("  %-10s %10lu %8u\n", "total",
+			(unsigned long)totbytes, totlive);
+	}
+	if (untracked > 0) {
+		kprintf("  (%u allocations made while the table was full "
+			"were not tracked)\n", untracked);
+	}
+}
@@ -38,18 +38,161 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <vfs.h>
 #include <uio.h>
+#include <vnode.h>
 #include <cpu.h>
+#include <bitmap.h>
+#include <device.h>
+#include <synch.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
+#include <kmemcache.h>
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct spinlock spinlkcore =  SPINLOCK_INITIALIZER;;
+static struct spinlock spinlkswap = SPINLOCK_INITIALIZER;
+static struct semaphore *sem_pageout;
+static struct semaphore *sem_zero;
+static struct wchan *wc_vmbusy;	//threads waiting for a busy frame or page
+static struct kmem_cache *ptcache;	//second-level tables, kept zeroed
+
+/*
+ * TLB entries carry the ASID of their address space. Each CPU hands
+ * out its own ASIDs; as_asid[cpu] holds (generation << 6 | asid) and
+ * asid_next[cpu] the last value that CPU handed out. When a CPU runs
+ * out of ASIDs it flushes its TLB and starts a new generation, which
+ * makes every ASID it gave out before stale. asid_owner maps a CPU's
+ * live ASIDs back to address spaces so a shootdown, which can arrive
+ * after the address space is gone, never has to dereference one.
+ */
+static struct spinlock spinlkasid = SPINLOCK_INITIALIZER;
+static uint32_t asid_next[MAXCPUS];
+static uint32_t asid_cur[MAXCPUS];	//ASID in c0_entryhi, 0 if none
+static struct addrspace *asid_owner[MAXCPUS][NUM_ASID];
+#define ASID_MASK (NUM_ASID - 1)
+
+/*
+ * Hardware page tables for the UTLB refill handler in
+ * exception-mips1.S. Each address space has a directory of
+ * NUM_UBERPAGES pointers to tables of NUM_SUBPAGES EntryLo words,
+ * indexed the same way as uberArray. A word is nonzero only while
+ * vm_fault has handed that translation out; whatever takes it back
+ * (claiming the frame, the clock's front hand, vm_asid_release) zeroes
+ * the word before shooting down TLB entries, so the next miss on the
+ * page comes through vm_fault again. cpupagetables[cpu] is the
+ * directory of the address space whose ASID is current on that CPU,
+ * 0 if none; it changes only with asid_cur, under spinlkasid.
+ */
+vaddr_t cpupagetables[MAXCPUS];
+
+/*
+ * Text page cache hash chains (through memorypage.nextcached) and
+ * spare reverse map entries, both under spinlkcore. Spares are never
+ * given back to kmalloc: kfree could land in free_kpages, which takes
+ * spinlkcore.
+ */
+static index_t pagecache[PAGECACHE_SIZE];
+static struct rmap *rmapfree;
+
+static int swaprun(index_t *frames, unsigned npages, index_t swapoffset, enum uio_rw rw);
+static void tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+static int pt_ctor(void *obj);
+static int vm_handlefault(struct addrspace *as, int faulttype, vaddr_t faultaddress, bool map);
+static unsigned findfreeswaprun(struct addrspace *as, unsigned want, index_t *first);
+
+/*
+ * Buddy allocator over the coremap. Free memory is kept as aligned
+ * blocks of 2^order frames on per-order lists; freeing a frame merges
+ * it with its buddy as long as the buddy is free and the same size.
+ * Single pages come off order 0 (splitting a larger block if needed)
+ * so they stay O(1). Caller holds spinlkcore (or is vm_bootstrap).
+ */
+static
+void
+buddy_link(index_t index, int order)
+{
+	struct memorypage *page = &g_coremap.physicalpages[index];
+
+	KASSERT(page->state == PAGE_FREE);
+	KASSERT(page->freeorder == -1);
+	page->freeorder = order;
+	page->prevfree = COREMAP_NONE;
+	page->nextfree = g_coremap.freeheads[order];
+	if(g_coremap.freeheads[order] != COREMAP_NONE)
+		g_coremap.physicalpages[g_coremap.freeheads[order]].prevfree = index;
+	g_coremap.freeheads[order] = index;
+}
+
+static
+void
+buddy_unlink(index_t index)
+{
+	struct memorypage *page = &g_coremap.physicalpages[index];
+
+	int order = page->freeorder;
+
+	KASSERT(page->state == PAGE_FREE);
+	KASSERT(order >= 0);
+	if(page->prevfree != COREMAP_NONE)
+		g_coremap.physicalpages[page->prevfree].nextfree = page->nextfree;
+	else
+		g_coremap.freeheads[order] = page->nextfree;
+	if(page->nextfree != COREMAP_NONE)
+		g_coremap.physicalpages[page->nextfree].prevfree = page->prevfree;
+	page->nextfree = page->prevfree = COREMAP_NONE;
+	page->freeorder = -1;
+}
+
+/* Return a block of 2^order frames (already marked PAGE_FREE), merging buddies. */
+static
+void
+buddy_free(index_t index, int order)
+{
+	g_coremap.nfreepages += (1 << order);
+	while(order < COREMAP_MAXORDER)
+	{
+		uint32_t buddy = index ^ (1 << order);
+		if(buddy >= g_coremap.numpages || g_coremap.physicalpages[buddy].freeorder != order)
+			break;
+		buddy_unlink(buddy);
+		index &= ~(1 << order);
+		order++;
+	}
+	buddy_link(index, order);
+}
+
+/* Take a block of 2^order frames, or COREMAP_NONE. */
+static
+index_t
+buddy_alloc(int order)
+{
+	int k = order;
+	while(k <= COREMAP_MAXORDER && g_coremap.freeheads[k] == COREMAP_NONE)
+		k++;
+	if(k > COREMAP_MAXORDER)
+		return COREMAP_NONE;
+
+	index_t index = g_coremap.freeheads[k];
+	buddy_unlink(index);
+	while(k > order)	//hand the upper halves back
+	{
+		k--;
+		buddy_link(index + (1 << k), k);
+	}
+	g_coremap.nfreepages -= (1 << order);
+	return index;
+}
 
 void
 vm_bootstrap(void)
 {
 	paddr_t firstaddr, lastaddr;
 	ram_getsize(&firstaddr, &lastaddr);
+	if(lastaddr > PTE_MAXFRAMES * PAGE_SIZE)
+		lastaddr = PTE_MAXFRAMES * PAGE_SIZE;	//a page table entry can't name any frame past that
 	g_coremap.numpages = ROUNDDOWN(lastaddr, PAGE_SIZE) / PAGE_SIZE;
 	g_coremap.physicalpages = (struct memorypage*) PADDR_TO_KVADDR(firstaddr);
 	g_coremap.freeaddr = firstaddr + g_coremap.numpages * sizeof(struct memorypage);
@@ -62,15 +205,125 @@ vm_bootstrap(void)
 	for(i = 0; i< ncpages; i++)
 	{
 		g_coremap.physicalpages[i].state = PAGE_FIXED;
+		g_coremap.physicalpages[i].as = NULL;
+		g_coremap.physicalpages[i].refcount = 0;
+		g_coremap.physicalpages[i].referenced = false;
+		g_coremap.physicalpages[i].queued = false;
+		g_coremap.physicalpages[i].prefetched = false;
+		g_coremap.physicalpages[i].dropbehind = false;
+		g_coremap.physicalpages[i].busy = false;
 	}
-	for(;i<g_coremap.numpages;i++)
+	for(i = ncpages; i<g_coremap.numpages;i++)
 	{
 		g_coremap.physicalpages[i].state = PAGE_FREE;
+		g_coremap.physicalpages[i].as = NULL;
+		g_coremap.physicalpages[i].refcount = 0;
+		g_coremap.physicalpages[i].referenced = false;
+		g_coremap.physicalpages[i].queued = false;
+		g_coremap.physicalpages[i].prefetched = false;
+		g_coremap.physicalpages[i].dropbehind = false;
+		g_coremap.physicalpages[i].busy = false;
+	}
+	for(i = 0; i<g_coremap.numpages; i++)
+	{
+		g_coremap.physicalpages[i].freeorder = -1;
+		g_coremap.physicalpages[i].cached = false;
+		g_coremap.physicalpages[i].cacheanon = NULL;
+		g_coremap.physicalpages[i].rmap = NULL;
+		g_coremap.physicalpages[i].kmowner = NULL;
+	}
+	for(i = 0; i < PAGECACHE_SIZE; i++)
+	{
+		pagecache[i] = COREMAP_NONE;
+	}
+	for(int order = 0; order <= COREMAP_MAXORDER; order++)
+	{
+		g_coremap.freeheads[order] = COREMAP_NONE;
+	}
+	g_coremap.nfreepages = 0;
+	g_coremap.nmultialloc = 0;
+	g_coremap.nmultievict = 0;
+	g_coremap.policy = VM_EVICT_CLOCK;
+	g_coremap.swapcounter = 0;
+	g_coremap.clockfront = g_coremap.numpages / 4;	//hand spread
+	g_coremap.nevictions = 0;
+	g_coremap.nwritebacks = 0;
+	g_coremap.nrefaults = 0;
+	g_coremap.nfilereads = 0;
+	g_coremap.ndiscards = 0;
+	g_coremap.nfilewrites = 0;
+	g_coremap.ncached = 0;
+	g_coremap.ncachehits = 0;
+	g_coremap.dropqhead = 0;
+	g_coremap.dropqlen = 0;
+	g_coremap.nseqreads = 0;
+	g_coremap.ndropbehind = 0;
+	g_coremap.nwillneed = 0;
+	g_coremap.ndontneed = 0;
+	g_coremap.lowater = g_coremap.numpages / 32;
+	if(g_coremap.lowater < 4)
+		g_coremap.lowater = 4;
+	g_coremap.hiwater = 2 * g_coremap.lowater;
+	g_coremap.cleanq = NULL;	//vm_pageout_bootstrap
+	g_coremap.cleanqhead = 0;
+	g_coremap.cleanqlen = 0;
+	g_coremap.pageoutwanted = false;
+	g_coremap.npageouts = 0;
+	g_coremap.ncleanreclaims = 0;
+	g_coremap.nwaiters = 0;
+	g_coremap.nactivations = 0;
+	g_coremap.nasids = 0;
+	g_coremap.nasidflushes = 0;
+	g_coremap.nfaults = 0;
+	g_coremap.nhwpttables = 0;
+	for(i = 0; i < MAXCPUS; i++)
+	{
+		asid_next[i] = NUM_ASID;	//generation 1, nothing handed out yet
+		asid_cur[i] = 0;
+	}
+	for(i = ncpages; i<g_coremap.numpages; )	//carve the free frames into the largest aligned blocks
+	{
+		int order = COREMAP_MAXORDER;
+		while( (i & ((1 << order) - 1)) != 0 || i + (1 << order) > g_coremap.numpages)
+			order--;
+		buddy_free(i, order);
+		i += (1 << order);
 	}
 	g_coremap.bisbootstrapdone = true;
+	kheap_bootstrap();	//tag the heap pages kmalloc already has
+	ptcache = kmem_cache_create("pagetable", NUM_SUBPAGES * sizeof(pte_t), 0, pt_ctor, NULL);
+	if(ptcache == NULL)
+		panic("vm_bootstrap: no memory for the page table cache\n");
 
-	g_swapper.fileend=0;
 	g_swapper.lk_swapper = lock_create("swapperlock");
+	wc_vmbusy = wchan_create("vmbusy");
+	if(wc_vmbusy == NULL)
+		panic("vm_bootstrap: no memory for the busy wchan\n");
+	g_swapper.slotmap = bitmap_create(SWAP_MAXSLOTS);
+	if(g_swapper.slotmap == NULL)
+		panic("vm_bootstrap: no memory for the swap bitmap\n");
+	paddr_t zero = allocate_onepage();	//fixed, so never evicted or freed
+	page_zero(PADDR_TO_KVADDR(zero));
+	g_coremap.zeroframe = zero / PAGE_SIZE;
+	g_coremap.nzeroreads = 0;
+	g_coremap.nzerowrites = 0;
+	g_coremap.nzeropool = 0;
+	g_coremap.zeropooltarget = ZEROPOOL_DEFAULT;
+	g_coremap.zerowanted = false;
+	g_coremap.nzerohits = 0;
+	g_coremap.nzeromisses = 0;
+	g_coremap.nzeroidle = 0;
+	g_swapper.ndevs = 0;
+	g_swapper.nslots = SWAP_MAXSLOTS;
+	g_swapper.cursor = 0;
+	g_swapper.slotsinuse = 0;
+	g_swapper.maxslotsinuse = 0;
+	g_swapper.nclusterwrites = 0;
+	g_swapper.nclusterpages = 0;
+	g_swapper.rawindow = 1;
+	g_swapper.nprefetched = 0;
+	g_swapper.nrahits = 0;
+	g_swapper.nrawasted = 0;
 
 
 	//TODO set flag for alloc kpages
@@ -108,268 +361,1622 @@ alloc_kpages(int npages)
 	}
 	else
 	{
-		vaddr_t retaddress = 0;
+		paddr_t pa;
 		//allocate from coremap
 		if(npages == 1)
 		{
-			retaddress = PADDR_TO_KVADDR(allocate_onepage());
+			pa = allocate_onepage();
 		}
 		else
 		{
-			retaddress = PADDR_TO_KVADDR(allocate_multiplepages(npages));
+			pa = allocate_multiplepages(npages);
 		}
-		return retaddress;
+		if(pa == 0)
+			return 0;
+		return PADDR_TO_KVADDR(pa);
 	}
 
 	return 0; //just to let it compile now
 }
 
-paddr_t allocate_onepage(void)
+/*
+ * Sleep until some busy frame or page is let go of. Caller holds
+ * spinlkcore, which is dropped while asleep and held again on return;
+ * whatever it was waiting for needs checking again.
+ */
+static
+void
+vm_wait(void)
 {
-	spinlock_acquire(&spinlkcore);
-
-	for(uint32_t i=0;i<g_coremap.numpages;i++)
-	{
-		if( g_coremap.physicalpages[i].state == PAGE_FREE)
-		{
-			g_coremap.physicalpages[i].numallocations = 1;
-			g_coremap.physicalpages[i].state = PAGE_FIXED;
-			spinlock_release(&spinlkcore);
-			return (i*PAGE_SIZE);
-		}
-	}
+	g_coremap.nwaiters++;
+	wchan_lock(wc_vmbusy);
 	spinlock_release(&spinlkcore);
-
-	index_t index;
-	int err= chooseframetoevict(&index);
-	if(err)
-		panic("nopage for kernel :(");
-	KASSERT(g_coremap.physicalpages[index].state != PAGE_FIXED && g_coremap.physicalpages[index].state != PAGE_FREE);
-
-	 err = swapout(&index, false, NULL);
-	if(err)
-		panic("err");
+	wchan_sleep(wc_vmbusy);
 	spinlock_acquire(&spinlkcore);
+	g_coremap.nwaiters--;
+}
 
-	g_coremap.physicalpages[index].numallocations = 1;
-	g_coremap.physicalpages[index].state = PAGE_FIXED;
+/* Release spinlkcore after clearing a busy bit, waking any waiters. */
+static
+void
+coremap_unlock_wake(void)
+{
+	bool wake = g_coremap.nwaiters > 0;
 	spinlock_release(&spinlkcore);
+	if(wake)
+		wchan_wakeall(wc_vmbusy);
+}
 
-	return (index*PAGE_SIZE);
+static
+pte_t *
+frame_pte(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	return &frame->as->uberArray[VADDR_TO_UBERINDEX(frame->vpage)][VADDR_TO_SUBINDEX(frame->vpage)];
+}
 
-	//TODO: need to evict here
-	panic("no page");
-	return 0;
+static
+pte_t *
+rmap_pte(struct rmap *rm)
+{
+	return &rm->as->uberArray[VADDR_TO_UBERINDEX(rm->vaddr)][VADDR_TO_SUBINDEX(rm->vaddr)];
 }
 
-paddr_t allocate_multiplepages(int npages)
+/* Stop the refill handler from loading VADDR in AS. */
+static
+void
+hwpt_clear(struct addrspace *as, vaddr_t vaddr)
 {
+	uint32_t *table = as->as_hwpt[VADDR_TO_UBERINDEX(vaddr)];
+	if(table != NULL)
+		table[VADDR_TO_SUBINDEX(vaddr)] = 0;
+}
 
-	index_t i=0;
-	int count = 0;
-	bool found = false;
-	spinlock_acquire(&spinlkcore);
+/*
+ * Set or clear BITS in every page table entry that maps frame INDEX,
+ * dropping it from the hardware page tables as well. Caller holds
+ * spinlkcore.
+ */
+static
+void
+frame_ptebits(index_t index, pte_t bits, bool set)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
 
-	while(i< g_coremap.numpages)
+	if(!frame->cached)
 	{
-		if(g_coremap.physicalpages[i].state == PAGE_FREE)
-		{
-			count++;
-		}
+		if(set)
+			*frame_pte(index) |= bits;
 		else
-		{
-			count = 0;
-		}
-		if(count == npages)
-		{
-			break; //found enough contiguous pages, so stop the search
-			found = true;
-		}
-		i++;
+			*frame_pte(index) &= ~bits;
+		hwpt_clear(frame->as, frame->vpage);
+		return;
 	}
-	spinlock_release(&spinlkcore);
-
-	if(!found)
+	for(struct rmap *rm = frame->rmap; rm != NULL; rm = rm->next)
 	{
-		count = 0;
-		int err=chooseframetoevict(&i);
-		if(err)
-			panic("no page for kernel");
-		while(i< g_coremap.numpages)
-		{
-			if(g_coremap.physicalpages[i].state != PAGE_FIXED)
-			{
-				count++;
-			}
-			else
-			{
-				count = 0;
-			}
-			if(count == npages)
-			{
-				break; //found enough contiguous pages, so stop the search
-				found = true;
-			}
-			i++;
-		}
+		if(set)
+			*rmap_pte(rm) |= bits;
+		else
+			*rmap_pte(rm) &= ~bits;
+		hwpt_clear(rm->as, rm->vaddr);
 	}
-	if(count == npages)
+}
+
+/* Drop every TLB entry, on every CPU, for the claimed frame INDEX. */
+static
+void
+frame_shootdown(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	struct tlbshootdown ts;
+
+	if(!frame->cached)
 	{
-		for(index_t j = i - npages + 1; j <= i ; j++)	// counter i would have stopped after npages of our start
-		{
-			if(g_coremap.physicalpages[j].state!= PAGE_FREE)
-			{
-				index_t index = j;
-				swapout(&index, false, NULL);
-			}
-			g_coremap.physicalpages[j].state = PAGE_FIXED;
-			g_coremap.physicalpages[j].numallocations = 0;//to indicate that this is part of multiple page allocation
-		}
+		ts.ts_addrspace = frame->as;
+		ts.ts_vaddr = frame->vpage;
+		vm_tlbshootdown(&ts);	//the victim may well belong to the process that is running here
+		ipi_tlbshootdown_broadcast(&ts);
+		return;
 	}
-	else
+	for(struct rmap *rm = frame->rmap; rm != NULL; rm = rm->next)
 	{
-		panic("insufficient contiguous pages");
-		//TODO:Need to call evict here and make enuf room
+		ts.ts_addrspace = rm->as;
+		ts.ts_vaddr = rm->vaddr;
+		vm_tlbshootdown(&ts);
+		ipi_tlbshootdown_broadcast(&ts);
 	}
-	g_coremap.physicalpages[i-npages +1].numallocations = npages;
-	return (PAGE_SIZE * (i-npages +1));
 }
 
-int allocate_userpage(struct addrspace* for_as, int uberindex, int subindex, index_t *retval)
+/* A reverse map entry; call without spinlkcore. */
+static
+struct rmap *
+rmap_get(void)
 {
-	KASSERT(for_as != NULL);
-	spinlock_acquire(&spinlkcore);
-	for(index_t i=0;i<g_coremap.numpages;i++)
-	{
-		if( g_coremap.physicalpages[i].state == PAGE_FREE)
-		{
-			g_coremap.physicalpages[i].numallocations = 1;
-			g_coremap.physicalpages[i].state = PAGE_DIRTY;
-			g_coremap.physicalpages[i].as = for_as;
-			g_coremap.physicalpages[i].vpage = INDECES_TO_VADDR(uberindex,subindex);
-			spinlock_release(&spinlkcore);
-			memset((void *)(PADDR_TO_KVADDR(i * PAGE_SIZE)), 0, PAGE_SIZE );
-			*retval = i;
+	struct rmap *rm;
 
-			return 0;
-		}
-	}
-	*retval = -1;
-	spinlock_release(&spinlkcore);
-	int err = swapout(retval, true, NULL);
-	if(err)
-	{
-		return err;
-	}
 	spinlock_acquire(&spinlkcore);
-	g_coremap.physicalpages[*retval].numallocations = 1;
-	g_coremap.physicalpages[*retval].state = PAGE_DIRTY;
-	g_coremap.physicalpages[*retval].as = for_as;
-	g_coremap.physicalpages[*retval].vpage = INDECES_TO_VADDR(uberindex,subindex);
-	memset((void *)(PADDR_TO_KVADDR((*retval) * PAGE_SIZE)), 0, PAGE_SIZE );
-
+	rm = rmapfree;
+	if(rm != NULL)
+		rmapfree = rm->next;
 	spinlock_release(&spinlkcore);
+	if(rm == NULL)
+		rm = kmalloc(sizeof(struct rmap));
+	return rm;
+}
 
-	return 0;
+/* Caller holds spinlkcore. */
+static
+void
+rmap_put(struct rmap *rm)
+{
+	rm->next = rmapfree;
+	rmapfree = rm;
 }
 
-void free_userpage(index_t index)
+/* Pages are cached under a vnode or, for shared anonymous memory, an anonobj; the other is NULL. */
+static
+unsigned
+pagecache_hash(struct vnode *vn, struct anonobj *anon, uint32_t off, vaddr_t vaddr)
 {
-	KASSERT(g_coremap.physicalpages[index].state != PAGE_FREE);
-	KASSERT(g_coremap.physicalpages[index].state != PAGE_FIXED);
-	//KASSERT(g_coremap.physicalpages[index].pa )
-	spinlock_acquire(&spinlkcore);
-	g_coremap.physicalpages[index].numallocations = 0;
-	g_coremap.physicalpages[index].state = PAGE_FREE;
-	g_coremap.physicalpages[index].as = NULL;
-	//memset((void *)PADDR_TO_KVADDR(g_coremap.physicalpages[index].pa), 0, PAGE_SIZE );
-	spinlock_release(&spinlkcore);
+	return (((uintptr_t)vn >> 4) ^ ((uintptr_t)anon >> 4) ^ (off >> 12) ^ (vaddr >> 12)) % PAGECACHE_SIZE;
 }
 
-void* memset(void *ptr, int ch, size_t len)
+/* Caller holds spinlkcore. */
+static
+index_t
+pagecache_lookup(struct vnode *vn, struct anonobj *anon, uint32_t off, vaddr_t vaddr)
 {
-	char *p = ptr;
-	size_t i;
+	index_t i;
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	for(i = pagecache[pagecache_hash(vn, anon, off, vaddr)]; i != COREMAP_NONE; i = g_coremap.physicalpages[i].nextcached)
+	{
+		struct memorypage *frame = &g_coremap.physicalpages[i];
+		if(frame->cachevn == vn && frame->cacheanon == anon && frame->cacheoff == off && frame->vpage == vaddr)
+			break;
 	}
+	return i;
+}
 
-	return ptr;
+/* Take frame INDEX out of the text page cache. Caller holds spinlkcore. */
+static
+void
+pagecache_remove(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	index_t *prev = &pagecache[pagecache_hash(frame->cachevn, frame->cacheanon, frame->cacheoff, frame->vpage)];
+
+	while(*prev != index)
+		prev = &g_coremap.physicalpages[*prev].nextcached;
+	*prev = frame->nextcached;
+	frame->cached = false;
+	frame->cachevn = NULL;
+	frame->cacheanon = NULL;
+	frame->rmap = NULL;
+	g_coremap.ncached--;
+}
+
+/*
+ * Take a user frame away from its owner for eviction or pageout: the
+ * frame goes busy and its page table entry VPAGE_BUSY, so faults on
+ * the page and as_destroy wait for us. Its hardware page table entry
+ * goes too, before anyone shoots down TLBs for it. Caller holds
+ * spinlkcore.
+ */
+static
+bool
+claimframe(index_t index)
+{
+	if(!isevictable(index))
+		return false;
+	g_coremap.physicalpages[index].busy = true;
+	frame_ptebits(index, VPAGE_BUSY, true);
+	return true;
 }
 
+/* Give a claimed frame back to its owner, still mapped. */
+static
 void
-free_kpages(vaddr_t kaddr)
+unclaimframe(index_t index)
 {
-	if(g_coremap.bisbootstrapdone == false || KVADDR_TO_PADDR(kaddr) < g_coremap.freeaddr)
-		return ;// leak memory for memsteals
-	KASSERT(kaddr % PAGE_SIZE == 0);
-	paddr_t addr = KVADDR_TO_PADDR(kaddr);
 	spinlock_acquire(&spinlkcore);
+	KASSERT(g_coremap.physicalpages[index].busy);
+	frame_ptebits(index, VPAGE_BUSY, false);
+	g_coremap.physicalpages[index].busy = false;
+	coremap_unlock_wake();
+}
 
-	int startindex = addr/PAGE_SIZE;
-	KASSERT(g_coremap.physicalpages[startindex].numallocations != 0);
-	KASSERT(startindex + g_coremap.physicalpages[startindex].numallocations < g_coremap.numpages);
-	for(uint32_t i=startindex; i< startindex + g_coremap.physicalpages[startindex].numallocations; i++ )
+/*
+ * Wake the pageout daemon if free memory is getting low. Caller holds
+ * spinlkcore; returns true if the caller should V(sem_pageout) once it
+ * has let go of it.
+ */
+static
+bool
+pageout_check(void)
+{
+	if(sem_pageout == NULL || g_coremap.pageoutwanted || g_coremap.nfreepages >= g_coremap.lowater)
+		return false;
+	g_coremap.pageoutwanted = true;
+	return true;
+}
+
+/*
+ * Same for the zeroing thread: wake it if the pool is short and there
+ * is free memory to spare for it.
+ */
+static
+bool
+zeropool_check(void)
+{
+	if(sem_zero == NULL || g_coremap.zerowanted || g_coremap.nzeropool >= g_coremap.zeropooltarget)
+		return false;
+	if(g_coremap.nfreepages <= g_coremap.hiwater)
+		return false;
+	g_coremap.zerowanted = true;
+	return true;
+}
+
+/*
+ * Take a frame off the daemon's clean queue. Entries go stale when the
+ * frame is written to, touched again, freed or shared after it was
+ * queued; those are dropped here.
+ */
+static
+bool
+cleanq_pop(index_t *retval)
+{
+	bool found = false;
+
+	spinlock_acquire(&spinlkcore);
+	while(!found && g_coremap.cleanqlen > 0)
 	{
-		KASSERT(g_coremap.physicalpages[i].state != PAGE_FREE);
-		KASSERT(g_coremap.physicalpages[i].state == PAGE_FIXED);
-		g_coremap.physicalpages[i].state = PAGE_FREE;
-		g_coremap.physicalpages[i].as = NULL;
-		//memset((void *)PADDR_TO_KVADDR(g_coremap.physicalpages[i].pa), 0, PAGE_SIZE );
+		index_t i = g_coremap.cleanq[g_coremap.cleanqhead];
+		g_coremap.cleanqhead = (g_coremap.cleanqhead + 1) % g_coremap.numpages;
+		g_coremap.cleanqlen--;
+		if(!g_coremap.physicalpages[i].queued)
+			continue;	//duplicate of an entry we already took
+		g_coremap.physicalpages[i].queued = false;
+		if(g_coremap.physicalpages[i].state == PAGE_CLEAN && !g_coremap.physicalpages[i].referenced && claimframe(i))
+		{
+			*retval = i;
+			found = true;
+		}
 	}
 	spinlock_release(&spinlkcore);
+	return found;
 }
 
-void copy_page(index_t dst, index_t src)
+static
+void
+cleanq_push(index_t index)
 {
+	if(g_coremap.cleanq == NULL)
+		return;	//no daemon yet
 	spinlock_acquire(&spinlkcore);
-	memcpy( (char*)PADDR_TO_KVADDR(PAGE_SIZE * dst), (char*)PADDR_TO_KVADDR(src * PAGE_SIZE), PAGE_SIZE);
+	if(!g_coremap.physicalpages[index].queued && g_coremap.cleanqlen < g_coremap.numpages)
+	{
+		g_coremap.cleanq[(g_coremap.cleanqhead + g_coremap.cleanqlen) % g_coremap.numpages] = index;
+		g_coremap.cleanqlen++;
+		g_coremap.physicalpages[index].queued = true;
+	}
 	spinlock_release(&spinlkcore);
 }
 
-void
-vm_tlbshootdown_all(void)
+/*
+ * Nothing is free: reclaim a user frame, which lands on the free lists.
+ * A frame the daemon already cleaned costs no I/O; otherwise we have
+ * to evict (and maybe write out) a page right here. Either way the
+ * victim is claimed before swapout sees it.
+ */
+static
+int
+reclaimframe(void)
 {
-	int spl = splhigh();
+	index_t victim;
 
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if(cleanq_pop(&victim))
+	{
+		g_coremap.ncleanreclaims++;
+		return swapout(&victim, false, NULL);
 	}
-	//as->tlbclock = 0;
-	splx(spl);
+	if(sem_pageout != NULL)
+		V(sem_pageout);	//we're behind, make sure it's running
+	return swapout(&victim, true, NULL);
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+paddr_t allocate_onepage(void)
 {
-	int spl = splhigh();
-	uint32_t ehi, elo;
-	//int32_t uberindex = VADDR_TO_UBERINDEX(ts->ts_vaddr);
-	//int32_t subindex = VADDR_TO_SUBINDEX(ts->ts_vaddr);
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if(ehi == ts->ts_vaddr)
-			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	for(;;)
+	{
+		spinlock_acquire(&spinlkcore);
+		if(g_coremap.nfreepages > 0 || g_coremap.nzeropool > 0)
+		{
+			index_t i = g_coremap.nfreepages > 0 ? buddy_alloc(0) : g_coremap.zeropool[--g_coremap.nzeropool];
+			g_coremap.physicalpages[i].numallocations = 1;
+			g_coremap.physicalpages[i].state = PAGE_FIXED;
+			bool wake = pageout_check();
+			spinlock_release(&spinlkcore);
+			if(wake)
+				V(sem_pageout);
+			return (i*PAGE_SIZE);
+		}
+		spinlock_release(&spinlkcore);
+
+		//nothing free, push a user page out and try again
+		int err = reclaimframe();
+		if(err)
+			panic("nopage for kernel :(");
 	}
-	//as->tlbclock = 0;
-	splx(spl);
+}
+
+/*
+ * Evict user pages to free up an aligned window of 2^order frames.
+ * Picks the window that needs the fewest evictions.
+ */
+static
+int
+makecontiguous(int order)
+{
+	uint32_t size = 1 << order;
+	uint32_t best = g_coremap.numpages;
+	uint32_t bestcost = size + 1;
+
+	for(uint32_t start = 0; start + size <= g_coremap.numpages; start += size)
+	{
+		uint32_t cost = 0;
+		uint32_t j;
+		for(j = start; j < start + size; j++)
+		{
+			if(g_coremap.physicalpages[j].state == PAGE_FREE)
+				continue;
+			if(!isevictable(j))
+				break;
+			cost++;
+		}
+		if(j == start + size && cost < bestcost)
+		{
+			best = start;
+			bestcost = cost;
+		}
+	}
+	if(best == g_coremap.numpages)
+		return ENOMEM;
+
+	for(uint32_t j = best; j < best + size; j++)
+	{
+		spinlock_acquire(&spinlkcore);
+		bool claimed = g_coremap.physicalpages[j].state != PAGE_FREE && claimframe(j);
+		spinlock_release(&spinlkcore);
+		if(claimed)
+		{
+			index_t index = j;
+			swapout(&index, false, NULL);	//evict hands it back to the buddy lists
+		}
+	}
+	return 0;	//if something got pinned meanwhile, the caller just tries again
+}
+
+paddr_t allocate_multiplepages(int npages)
+{
+	int order = 0;
+	bool evicted = false;
+
+	while((1 << order) < npages)
+		order++;
+	if(order > COREMAP_MAXORDER)
+		return 0;
+
+	for(;;)
+	{
+		spinlock_acquire(&spinlkcore);
+		index_t i = buddy_alloc(order);
+		if(i != COREMAP_NONE)
+		{
+			for(int j = npages; j < (1 << order); j++)	//give back the part of the block we don't need
+			{
+				buddy_free(i + j, 0);
+			}
+			for(int j = 0; j < npages; j++)
+			{
+				g_coremap.physicalpages[i + j].state = PAGE_FIXED;
+				g_coremap.physicalpages[i + j].numallocations = 0;//to indicate that this is part of multiple page allocation
+			}
+			g_coremap.physicalpages[i].numallocations = npages;
+			g_coremap.nmultialloc++;
+			if(evicted)
+				g_coremap.nmultievict++;
+			spinlock_release(&spinlkcore);
+			return (PAGE_SIZE * i);
+		}
+		spinlock_release(&spinlkcore);
+
+		if(makecontiguous(order))
+			panic("insufficient contiguous pages");
+		evicted = true;
+	}
+}
+
+int allocate_userpage(struct addrspace* for_as, int uberindex, int subindex, bool zero, index_t *retval)
+{
+	KASSERT(for_as != NULL);
+	for(;;)
+	{
+		spinlock_acquire(&spinlkcore);
+		index_t i = COREMAP_NONE;
+		bool zeroed = false;
+		if(zero && g_coremap.nzeropool > 0)
+		{
+			i = g_coremap.zeropool[--g_coremap.nzeropool];
+			zeroed = true;
+		}
+		else if(g_coremap.nfreepages > 0)
+		{
+			i = buddy_alloc(0);
+		}
+		else if(g_coremap.nzeropool > 0)
+		{
+			i = g_coremap.zeropool[--g_coremap.nzeropool];	//last free frames there are
+			zeroed = true;
+		}
+		if(i != COREMAP_NONE)
+		{
+			g_coremap.physicalpages[i].numallocations = 1;
+			g_coremap.physicalpages[i].refcount = 1;
+			g_coremap.physicalpages[i].referenced = true;
+			g_coremap.physicalpages[i].prefetched = false;
+			g_coremap.physicalpages[i].dropbehind = false;
+			g_coremap.physicalpages[i].busy = true;	//the caller unpins it once it's mapped
+			g_coremap.physicalpages[i].state = PAGE_DIRTY;
+			g_coremap.physicalpages[i].as = for_as;
+			g_coremap.physicalpages[i].vpage = INDECES_TO_VADDR(uberindex,subindex);
+			if(zero && zeroed)
+				g_coremap.nzerohits++;
+			else if(zero)
+				g_coremap.nzeromisses++;
+			bool wake = pageout_check();
+			bool wakezero = zeropool_check();
+			spinlock_release(&spinlkcore);
+			if(wake)
+				V(sem_pageout);
+			if(wakezero)
+				V(sem_zero);
+			if(zero && !zeroed)
+				page_zero(PADDR_TO_KVADDR(i * PAGE_SIZE));
+			*retval = i;
+
+			return 0;
+		}
+		spinlock_release(&spinlkcore);
+
+		//no free frame, evict one (it lands on the free list) and retry
+		int err = reclaimframe();
+		if(err)
+		{
+			return err;
+		}
+	}
+}
+
+/*
+ * Drop AS's mapping of a user frame. Caller holds spinlkcore. A frame
+ * that nobody maps any more can't stay pinned either.
+ */
+static
+void
+putframe(index_t index, struct addrspace *as)
+{
+	KASSERT(g_coremap.physicalpages[index].state != PAGE_FREE);
+	KASSERT(g_coremap.physicalpages[index].state != PAGE_FIXED);
+	KASSERT(g_coremap.physicalpages[index].refcount > 0);
+	if(g_coremap.physicalpages[index].cached)
+	{
+		struct rmap **prev = &g_coremap.physicalpages[index].rmap;
+		while((*prev)->as != as)
+			prev = &(*prev)->next;
+		struct rmap *rm = *prev;
+		*prev = rm->next;
+		rmap_put(rm);
+		if(g_coremap.physicalpages[index].refcount == 1)
+			pagecache_remove(index);	//nobody runs the file any more
+	}
+	g_coremap.physicalpages[index].refcount--;
+	if(g_coremap.physicalpages[index].refcount > 0)
+	{
+		if(g_coremap.physicalpages[index].as == as)
+			g_coremap.physicalpages[index].as = NULL;	//remaining sharer claims it on its next fault
+		return;
+	}
+	g_coremap.physicalpages[index].numallocations = 0;
+	g_coremap.physicalpages[index].state = PAGE_FREE;
+	g_coremap.physicalpages[index].as = NULL;
+	g_coremap.physicalpages[index].busy = false;
+	buddy_free(index, 0);
+	//memset((void *)PADDR_TO_KVADDR(g_coremap.physicalpages[index].pa), 0, PAGE_SIZE );
+}
+
+/*
+ * Drop AS's mapping of a user frame. The frame only goes back to the
+ * free pool once the last copy-on-write sharer lets go of it.
+ */
+void free_userpage(index_t index, struct addrspace *as)
+{
+	spinlock_acquire(&spinlkcore);
+	putframe(index, as);
+	coremap_unlock_wake();
+}
+
+/*
+ * Add another copy-on-write mapping of a user frame, at VADDR in AS
+ * (used by as_copy; the caller has the frame pinned). The new mapping
+ * has no swap slot behind it, so a clean frame has to be treated as
+ * dirty from now on - unless it is a cached text frame, which just
+ * gets another reverse map entry.
+ */
+int share_userpage(index_t index, struct addrspace *as, vaddr_t vaddr)
+{
+	struct rmap *rm = NULL;
+
+	if(g_coremap.physicalpages[index].cached)
+	{
+		rm = rmap_get();
+		if(rm == NULL)
+			return ENOMEM;
+		rm->as = as;
+		rm->vaddr = vaddr;
+	}
+	spinlock_acquire(&spinlkcore);
+	KASSERT(g_coremap.physicalpages[index].state != PAGE_FREE);
+	KASSERT(g_coremap.physicalpages[index].state != PAGE_FIXED);
+	KASSERT(g_coremap.physicalpages[index].refcount > 0);
+	g_coremap.physicalpages[index].refcount++;
+	if(rm != NULL)
+	{
+		rm->next = g_coremap.physicalpages[index].rmap;
+		g_coremap.physicalpages[index].rmap = rm;
+	}
+	else
+	{
+		g_coremap.physicalpages[index].state = PAGE_DIRTY;
+	}
+	spinlock_release(&spinlkcore);
+	return 0;
+}
+
+/*
+ * Pin the frame behind VPAGE so it stays put while we use it, first
+ * waiting out any eviction of the page or other pin on the frame.
+ * Returns false if the page isn't in memory (any more). Caller holds
+ * the page's as_lock.
+ */
+bool pin_userpage(pte_t *pte)
+{
+	spinlock_acquire(&spinlkcore);
+	for(;;)
+	{
+		if((*pte & VPAGE_BUSY) != 0)
+		{
+			vm_wait();
+			continue;
+		}
+		if((*pte & VPAGE_INMEMORY) == 0)
+		{
+			spinlock_release(&spinlkcore);
+			return false;
+		}
+		if(g_coremap.physicalpages[PTE_FRAME(*pte)].busy)
+		{
+			vm_wait();	//a copy-on-write sharer has it
+			continue;
+		}
+		break;
+	}
+	g_coremap.physicalpages[PTE_FRAME(*pte)].busy = true;
+	spinlock_release(&spinlkcore);
+	return true;
+}
+
+void unpin_userpage(index_t index)
+{
+	spinlock_acquire(&spinlkcore);
+	KASSERT(g_coremap.physicalpages[index].busy);
+	g_coremap.physicalpages[index].busy = false;
+	coremap_unlock_wake();
+}
+
+/*
+ * Tear down one page of AS (as_destroy, munmap): free its frame and swap slot
+ * and clear the entry. An eviction in progress finishes first; the
+ * entry is cleared under spinlkcore so an evictor looking at the
+ * neighbours of its victim never sees it half gone.
+ */
+void free_virtualpage(struct addrspace *as, int uberindex, int subindex)
+{
+	pte_t *pte = &as->uberArray[uberindex][subindex];
+	pte_t old;
+
+	spinlock_acquire(&spinlkcore);
+	while((*pte & VPAGE_BUSY) != 0)
+		vm_wait();
+	old = *pte;
+	if((old & VPAGE_INMEMORY) != 0)	//there exists a frame corresponding to virtual page, free it
+		putframe(PTE_FRAME(old), as);
+	*pte = VPAGE_UNINIT;
+	coremap_unlock_wake();
+
+	if((old & VPAGE_INSWAP) != 0)
+		swapfree(PTE_SLOT(old));
+}
+
+/*
+ * A frame can only be evicted if we know every page table entry that
+ * maps it: its owner's, or the reverse map of a cached text frame.
+ * Copy-on-write shared frames, frames whose owner went away and busy
+ * frames are skipped.
+ */
+bool isevictable(index_t index)
+{
+	struct memorypage *page = &g_coremap.physicalpages[index];
+	if(page->state != PAGE_CLEAN && page->state != PAGE_DIRTY)
+		return false;
+	if(page->cached)
+		return !page->busy;	//unmapped from all its sharers at once
+	return page->refcount <= 1 && page->as != NULL && !page->busy;
+}
+
+/*
+ * Give AS its own copy of a frame it shares with other address spaces.
+ * Called on the first write to a copy-on-write page, with the shared
+ * frame pinned; the new frame comes back pinned in its place.
+ */
+int copyonwrite(struct addrspace *as, int uberindex, int subindex)
+{
+	pte_t *pte = &as->uberArray[uberindex][subindex];
+	index_t oldindex = PTE_FRAME(*pte);
+	index_t newindex;
+
+	KASSERT((*pte & VPAGE_INMEMORY) != 0);
+	int err = allocate_userpage(as, uberindex, subindex, false, &newindex);	//shared frames are never evicted, so oldindex stays put
+	if(err)
+		return err;
+	copy_page(newindex, oldindex);
+	spinlock_acquire(&spinlkcore);
+	PTE_SETFRAME(*pte, newindex);
+	g_coremap.physicalpages[oldindex].busy = false;	//our pin goes with our reference
+	putframe(oldindex, as);
+	coremap_unlock_wake();
+	if((*pte & VPAGE_INSWAP) != 0)	//our copy in swap is stale now
+	{
+		swapfree(PTE_SLOT(*pte));
+		*pte &= ~VPAGE_INSWAP;
+	}
+	return 0;
+}
+
+/*
+ * Same shape as bzero: bytes up to a word boundary, words eight at a
+ * time, then the leftover words and bytes. Whole pages should go
+ * through page_zero instead.
+ */
+void* memset(void *ptr, int ch, size_t len)
+{
+	char *p = ptr;
+	unsigned long fill = (unsigned char)ch * ((unsigned long)-1 / 0xff);	//ch in every byte
+
+	while(len > 0 && (uintptr_t)p % sizeof(long) != 0)
+	{
+		*p++ = ch;
+		len--;
+	}
+	unsigned long *lp = (unsigned long *)p;
+	while(len >= 8 * sizeof(long))
+	{
+		lp[0] = fill;
+		lp[1] = fill;
+		lp[2] = fill;
+		lp[3] = fill;
+		lp[4] = fill;
+		lp[5] = fill;
+		lp[6] = fill;
+		lp[7] = fill;
+		lp += 8;
+		len -= 8 * sizeof(long);
+	}
+	while(len >= sizeof(long))
+	{
+		*lp++ = fill;
+		len -= sizeof(long);
+	}
+	p = (char *)lp;
+	while(len > 0)
+	{
+		*p++ = ch;
+		len--;
+	}
+
+	return ptr;
+}
+
+/*
+ * Zero the page at kernel address KVA. A page is aligned and whole, so
+ * there's no head or tail to handle and the loop is a straight run of
+ * stores, eight words (one cache line) per trip.
+ */
+void page_zero(vaddr_t kva)
+{
+	KASSERT(kva % PAGE_SIZE == 0);
+	uint32_t *p = (uint32_t *)kva;
+	for(uint32_t *end = p + PAGE_SIZE / sizeof(uint32_t); p < end; p += 8)
+	{
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = 0;
+		p[5] = 0;
+		p[6] = 0;
+		p[7] = 0;
+	}
+}
+
+/*
+ * Copy the page at kernel address SRC to DST, a cache line per trip.
+ * All eight loads go out before the stores so they can overlap.
+ */
+void page_copy(vaddr_t dst, vaddr_t src)
+{
+	KASSERT(dst % PAGE_SIZE == 0 && src % PAGE_SIZE == 0);
+	uint32_t *d = (uint32_t *)dst;
+	const uint32_t *s = (const uint32_t *)src;
+	for(uint32_t *end = d + PAGE_SIZE / sizeof(uint32_t); d < end; d += 8, s += 8)
+	{
+		uint32_t w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+		uint32_t w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+		d[0] = w0;
+		d[1] = w1;
+		d[2] = w2;
+		d[3] = w3;
+		d[4] = w4;
+		d[5] = w5;
+		d[6] = w6;
+		d[7] = w7;
+	}
+}
+
+/*
+ * The frame is the caller's (a fixed kernel page kmalloc holds), so
+ * no lock is needed to set or read its owner. Before the coremap
+ * exists there's nowhere to keep it. Pages stolen before then have
+ * coremap entries too, so they can be given owners afterwards.
+ */
+void
+vm_setkmowner(vaddr_t kaddr, void *owner)
+{
+	if(g_coremap.bisbootstrapdone == false)
+		return;
+	index_t index = KVADDR_TO_PADDR(kaddr) / PAGE_SIZE;
+	KASSERT(index < g_coremap.numpages);
+	KASSERT(g_coremap.physicalpages[index].state == PAGE_FIXED);
+	g_coremap.physicalpages[index].kmowner = owner;
+}
+
+void *
+vm_getkmowner(vaddr_t kaddr)
+{
+	if(g_coremap.bisbootstrapdone == false)
+		return NULL;
+	index_t index = KVADDR_TO_PADDR(kaddr) / PAGE_SIZE;
+	KASSERT(index < g_coremap.numpages);
+	return g_coremap.physicalpages[index].kmowner;
+}
+
+void
+free_kpages(vaddr_t kaddr)
+{
+	if(g_coremap.bisbootstrapdone == false || KVADDR_TO_PADDR(kaddr) < g_coremap.freeaddr)
+		return ;// leak memory for memsteals
+	KASSERT(kaddr % PAGE_SIZE == 0);
+	paddr_t addr = KVADDR_TO_PADDR(kaddr);
+	spinlock_acquire(&spinlkcore);
+
+	int startindex = addr/PAGE_SIZE;
+	KASSERT(g_coremap.physicalpages[startindex].numallocations != 0);
+	KASSERT(startindex + g_coremap.physicalpages[startindex].numallocations < g_coremap.numpages);
+	for(uint32_t i=startindex; i< startindex + g_coremap.physicalpages[startindex].numallocations; i++ )
+	{
+		KASSERT(g_coremap.physicalpages[i].state != PAGE_FREE);
+		KASSERT(g_coremap.physicalpages[i].state == PAGE_FIXED);
+		g_coremap.physicalpages[i].state = PAGE_FREE;
+		g_coremap.physicalpages[i].as = NULL;
+		buddy_free(i, 0);
+		//memset((void *)PADDR_TO_KVADDR(g_coremap.physicalpages[i].pa), 0, PAGE_SIZE );
+	}
+	spinlock_release(&spinlkcore);
+}
+
+//both frames are pinned by the caller, so neither can move and no lock is needed for the copy
+void copy_page(index_t dst, index_t src)
+{
+	page_copy(PADDR_TO_KVADDR(PAGE_SIZE * dst), PADDR_TO_KVADDR(src * PAGE_SIZE));
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int spl = splhigh();
+
+	for (int i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(asid_cur[curcpu->c_number]);
+	//as->tlbclock = 0;
+	splx(spl);
+}
+
+/*
+ * Give AS an ASID on this CPU if it doesn't have a live one, and make
+ * it the current one. Caller holds spinlkasid.
+ */
+static
+void
+asid_activate(struct addrspace *as)
+{
+	unsigned cpu = curcpu->c_number;
+
+	g_coremap.nactivations++;
+	if(as == NULL)
+	{
+		asid_cur[cpu] = 0;	//no user entries will match
+		cpupagetables[cpu] = 0;
+		tlb_setasid(0);
+		return;
+	}
+	if(as->as_asid[cpu] == 0 || ((as->as_asid[cpu] ^ asid_next[cpu]) & ~ASID_MASK) != 0)
+	{
+		uint32_t next = asid_next[cpu] + 1;
+		if((next & ASID_MASK) == 0)
+		{
+			//out of ASIDs: start a new generation with an empty TLB
+			for (int i=0; i<NUM_TLB; i++) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+			for(int a = 0; a < NUM_ASID; a++)
+				asid_owner[cpu][a] = NULL;
+			g_coremap.nasidflushes++;
+			next++;	//ASID 0 is for no address space
+		}
+		asid_next[cpu] = next;
+		as->as_asid[cpu] = next;
+		asid_owner[cpu][next & ASID_MASK] = as;
+		g_coremap.nasids++;
+	}
+	asid_cur[cpu] = as->as_asid[cpu] & ASID_MASK;
+	cpupagetables[cpu] = (vaddr_t)as->as_hwpt;
+	tlb_setasid(asid_cur[cpu]);
+}
+
+/* Switch this CPU to AS (or to none), see as_activate. */
+void
+vm_activate(struct addrspace *as)
+{
+	int spl = splhigh();
+	spinlock_acquire(&spinlkasid);
+	asid_activate(as);
+	spinlock_release(&spinlkasid);
+	splx(spl);
+}
+
+/*
+ * Drop every ASID AS has, on every CPU, which orphans all of its TLB
+ * entries everywhere at once. If AS is running here this CPU is left
+ * with no address space until as_activate. Used by as_destroy, and
+ * instead of flushing whole TLBs when AS's translations change
+ * wholesale.
+ */
+void
+vm_asid_release(struct addrspace *as)
+{
+	unsigned self = curcpu->c_number;
+	int spl;
+
+	//nothing may refill from the old translations once the ASIDs go
+	for(int i = 0; i < NUM_UBERPAGES; i++)
+	{
+		if(as->as_hwpt[i] != NULL)
+			memset(as->as_hwpt[i], 0, NUM_SUBPAGES * sizeof(uint32_t));
+	}
+
+	spl = splhigh();
+	spinlock_acquire(&spinlkasid);
+	if(asid_cur[self] != 0 && asid_owner[self][asid_cur[self]] == as)
+		asid_activate(NULL);
+	for(unsigned cpu = 0; cpu < MAXCPUS; cpu++)
+	{
+		uint32_t a = as->as_asid[cpu] & ASID_MASK;
+		if(a != 0 && asid_owner[cpu][a] == as)
+			asid_owner[cpu][a] = NULL;
+		as->as_asid[cpu] = 0;
+	}
+	spinlock_release(&spinlkasid);
+	splx(spl);
+}
+
+/*
+ * Second-level tables, both the uberArray sections and the refill
+ * handler's as_hwpt tables, come out of ptcache all VPAGE_UNINIT. A
+ * table normally goes back clean, since as_destroy frees every page
+ * first, so vm_pt_free only has to look; it clears whatever it finds.
+ */
+static
+int
+pt_ctor(void *obj)
+{
+	pte_t *pt = obj;
+	for(int i = 0; i < NUM_SUBPAGES; i++)
+		pt[i] = VPAGE_UNINIT;
+	return 0;
+}
+
+pte_t *
+vm_pt_alloc(void)
+{
+	return kmem_cache_alloc(ptcache);
+}
+
+void
+vm_pt_free(pte_t *pt)
+{
+	for(int i = 0; i < NUM_SUBPAGES; i++)
+	{
+		if(pt[i] != VPAGE_UNINIT)
+		{
+			pt_ctor(pt);
+			break;
+		}
+	}
+	kmem_cache_free(ptcache, pt);
+}
+
+/* Allocate AS's hardware page table directory. */
+int
+vm_hwpt_create(struct addrspace *as)
+{
+	as->as_hwpt = kmalloc(NUM_UBERPAGES * sizeof(uint32_t *));
+	if(as->as_hwpt == NULL)
+		return ENOMEM;
+	for(int i = 0; i < NUM_UBERPAGES; i++)
+		as->as_hwpt[i] = NULL;
+	return 0;
+}
+
+/* Free AS's hardware page tables. Its ASIDs must be gone already. */
+void
+vm_hwpt_destroy(struct addrspace *as)
+{
+	for(int i = 0; i < NUM_UBERPAGES; i++)
+	{
+		if(as->as_hwpt[i] != NULL)
+			vm_pt_free(as->as_hwpt[i]);
+	}
+	kfree(as->as_hwpt);
+	as->as_hwpt = NULL;
+}
+
+/*
+ * Let the refill handler load ELO for VADDR in AS from now on. If we
+ * can't get memory for the table the page just keeps faulting the
+ * slow way. Called with the page pinned and AS's lock held.
+ */
+static
+void
+hwpt_set(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	int uber = VADDR_TO_UBERINDEX(vaddr);
+
+	if(as->as_hwpt[uber] == NULL)
+	{
+		uint32_t *table = vm_pt_alloc();
+		if(table == NULL)
+			return;
+		as->as_hwpt[uber] = table;
+		g_coremap.nhwpttables++;
+	}
+	as->as_hwpt[uber][VADDR_TO_SUBINDEX(vaddr)] = elo;
+}
+
+/*
+ * Drop this CPU's translation for TS's page, tagged with whatever ASID
+ * its address space has here. If it has none, this CPU can't be
+ * holding anything for it.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl = splhigh();
+	unsigned cpu = curcpu->c_number;
+	uint32_t asid = 0;
+
+	spinlock_acquire(&spinlkasid);
+	for(uint32_t a = 1; a < NUM_ASID && asid == 0; a++)
+	{
+		if(asid_owner[cpu][a] == ts->ts_addrspace)
+			asid = a;
+	}
+	if(asid != 0)
+	{
+		int i = tlb_probe((ts->ts_vaddr & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT), 0);
+		if(i >= 0)
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		tlb_setasid(asid_cur[cpu]);
+	}
+	spinlock_release(&spinlkasid);
+	splx(spl);
+}
+
+/*
+ * Load a translation into the TLB, replacing any entry that already
+ * maps VADDR (a write to a read-only copy-on-write page faults with
+ * the old entry still present).
+ */
+static
+void
+tlbload(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	int i;
+	uint32_t ehi, elo;
+	int spl;
+
+	elo = paddr | TLBLO_VALID;
+	if(writable)
+		elo |= TLBLO_DIRTY;
+	hwpt_set(as, vaddr, elo);	//may allocate, so before splhigh
+
+	// Disable interrupts on this CPU while frobbing the TLB.
+	spl = splhigh();
+
+	KASSERT(asid_cur[curcpu->c_number] != 0);
+	ehi = vaddr | (asid_cur[curcpu->c_number] << TLBHI_PIDSHIFT);
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, paddr);
+
+	i = tlb_probe(ehi, 0);
+	if(i >= 0)
+	{
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		uint32_t oldehi, oldelo;
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	as->tlbclock = (as->tlbclock + 1) % NUM_TLB;
+	tlb_write(ehi, elo, as->tlbclock);
+	splx(spl);
+}
+
+/*
+ * Fill frame INDEX, which is zeroed, with page VADDR of the file-backed
+ * region SEG: whatever part of the page the file covers is read from
+ * it, the rest (BSS) stays zero. *FROMFILE says whether any of it came
+ * from the file, in which case the page can be dropped and read again
+ * for as long as nobody writes it.
+ */
+static
+int
+readfilepage(struct segment *seg, vaddr_t vaddr, index_t index, bool *fromfile)
+{
+	vaddr_t fileend = seg->startaddress + seg->filesize;
+	vaddr_t lo = vaddr > seg->startaddress ? vaddr : seg->startaddress;
+	vaddr_t hi = vaddr + PAGE_SIZE < fileend ? vaddr + PAGE_SIZE : fileend;
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	*fromfile = false;
+	if(lo >= hi)
+		return 0;	//all BSS
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(index * PAGE_SIZE) + (lo - vaddr)), hi - lo,
+		seg->fileoffset + (lo - seg->startaddress), UIO_READ);
+	err = VOP_READ(seg->vn, &ku);
+	if(err)
+		return err;
+	if(ku.uio_resid != 0 && (seg->flags & SEG_MMAP) == 0)	//a mapped file may just have shrunk, the rest stays zero
+	{
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	*fromfile = true;
+	g_coremap.nfilereads++;
+	return 0;
+}
+
+/*
+ * What page VADDR of SEG is cached under: text by its segment's file
+ * offset and its address, a shared mapping page by its own offset in
+ * the file (or anonobj) alone, since every process may map it
+ * somewhere else.
+ */
+static
+void
+pagecache_key(struct segment *seg, vaddr_t vaddr, uint32_t *off, vaddr_t *key)
+{
+	if((seg->flags & SEG_SHARED) != 0)
+	{
+		*off = seg->fileoffset + (vaddr - seg->startaddress);
+		*key = 0;
+	}
+	else
+	{
+		*off = seg->fileoffset;
+		*key = vaddr;
+	}
+}
+
+/*
+ * Under spinlkcore: if the text page cache has page VADDR of SEG, map
+ * it at PTE with reverse map entry RM and return it pinned. Waits out
+ * a frame that is busy (being read in, or evicted) and looks again.
+ */
+static
+bool
+pagecache_map(struct segment *seg, vaddr_t vaddr, pte_t *pte, struct rmap *rm)
+{
+	uint32_t off;
+	vaddr_t key;
+
+	pagecache_key(seg, vaddr, &off, &key);
+	for(;;)
+	{
+		index_t index = pagecache_lookup(seg->vn, seg->anon, off, key);
+		if(index == COREMAP_NONE)
+			return false;
+		struct memorypage *frame = &g_coremap.physicalpages[index];
+		if(frame->busy)
+		{
+			vm_wait();
+			continue;
+		}
+		frame->busy = true;
+		frame->refcount++;
+		rm->next = frame->rmap;
+		frame->rmap = rm;
+		*pte = VPAGE_INMEMORY | index;
+		g_coremap.ncachehits++;
+		return true;
+	}
+}
+
+/*
+ * Fault in page VADDR of a read-only or shared region through the
+ * page cache: map the frame another process already brought it into,
+ * or bring it into a new frame and cache that. File pages are read
+ * from the file; shared anonymous pages from their object's swap
+ * slot, or are zeros if they have never been written out. Returns
+ * with the frame pinned, like swapin.
+ */
+static
+int
+cachedpagein(struct addrspace *as, struct segment *seg, vaddr_t vaddr, pte_t *pte)
+{
+	struct rmap *rm;
+	index_t index;
+	index_t slot = ANON_NOSLOT;
+	bool fromfile;
+	uint32_t off;
+	vaddr_t key;
+	int err;
+
+	rm = rmap_get();
+	if(rm == NULL)
+		return ENOMEM;
+	rm->as = as;
+	rm->vaddr = vaddr;
+	pagecache_key(seg, vaddr, &off, &key);
+
+	spinlock_acquire(&spinlkcore);
+	if(pagecache_map(seg, vaddr, pte, rm))
+	{
+		spinlock_release(&spinlkcore);
+		return 0;
+	}
+	spinlock_release(&spinlkcore);
+
+	//a page's slot, once it has one, stays until the object goes; the read will overwrite the frame
+	if(seg->anon != NULL)
+		slot = seg->anon->slots[off / PAGE_SIZE];
+	err = allocate_userpage(as, VADDR_TO_UBERINDEX(vaddr), VADDR_TO_SUBINDEX(vaddr), slot == ANON_NOSLOT, &index);
+	if(err)
+	{
+		spinlock_acquire(&spinlkcore);
+		rmap_put(rm);
+		spinlock_release(&spinlkcore);
+		return err;
+	}
+
+	spinlock_acquire(&spinlkcore);
+	if(pagecache_map(seg, vaddr, pte, rm))
+	{
+		//somebody read it in while we were allocating
+		putframe(index, as);
+		coremap_unlock_wake();
+		return 0;
+	}
+	//ours is the copy; it stays busy, so others wait for the read
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	unsigned bucket = pagecache_hash(seg->vn, seg->anon, off, key);
+	frame->as = NULL;
+	frame->state = PAGE_CLEAN;
+	frame->cached = true;
+	frame->cachevn = seg->vn;
+	frame->cacheanon = seg->anon;
+	if(seg->anon != NULL)
+	{
+		frame->refcount++;	//the object's own, see struct anonobj
+		slot = seg->anon->slots[off / PAGE_SIZE];	//it may have gone out while we were allocating
+	}
+	frame->cacheoff = off;
+	frame->vpage = key;
+	frame->rmap = rm;
+	rm->next = NULL;
+	frame->nextcached = pagecache[bucket];
+	pagecache[bucket] = index;
+	g_coremap.ncached++;
+	*pte = VPAGE_INMEMORY | index;
+	spinlock_release(&spinlkcore);
+
+	if(seg->anon == NULL)
+	{
+		err = readfilepage(seg, vaddr, index, &fromfile);
+	}
+	else if(slot != ANON_NOSLOT)
+	{
+		err = swaprun(&index, 1, slot, UIO_READ);	//clean against the slot until the first write
+		if(err == 0)
+			g_coremap.nrefaults++;
+	}
+	if(err)
+	{
+		spinlock_acquire(&spinlkcore);
+		*pte = VPAGE_UNINIT;
+		if(seg->anon != NULL)
+			frame->refcount--;	//the object has nothing worth keeping either
+		putframe(index, as);	//last mapping, so out of the cache and freed
+		coremap_unlock_wake();
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * VADDR in AS has been reading the shared zero page and is about to
+ * get a frame of its own. Other CPUs, and the refill handler through
+ * as_hwpt, may still have it on the zero page, so take it away from
+ * them first.
+ */
+static
+void
+zerofill_drop(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	struct tlbshootdown ts;
+
+	hwpt_clear(as, vaddr);
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	vm_tlbshootdown(&ts);
+	ipi_tlbshootdown_broadcast(&ts);
+	*pte = VPAGE_UNINIT;
+	g_coremap.nzerowrites++;
+}
+
+/* Does page VADDR of SEG start out as nothing but zeros? */
+static
+bool
+iszerofill(struct segment *seg, vaddr_t vaddr)
+{
+	return seg->vn == NULL || vaddr >= seg->startaddress + seg->filesize;
+}
+
+/*
+ * Take the oldest frame a sequential scan left behind off the
+ * drop-behind queue, skipping any that were touched again since or
+ * are no longer evictable. Caller holds spinlkcore.
+ */
+static
+bool
+dropq_pop(index_t *retval)
+{
+	while(g_coremap.dropqlen > 0)
+	{
+		index_t i = g_coremap.dropq[g_coremap.dropqhead];
+		struct memorypage *frame = &g_coremap.physicalpages[i];
+		g_coremap.dropqhead = (g_coremap.dropqhead + 1) % DROPQ_SIZE;
+		g_coremap.dropqlen--;
+		if(!frame->dropbehind)
+			continue;	//touched again, or freed, since
+		frame->dropbehind = false;
+		if(!frame->referenced && !frame->queued && isevictable(i))
+		{
+			*retval = i;
+			g_coremap.ndropbehind++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * A sequential scan has gone past page VADDR of AS: unless somebody
+ * else maps it too, make it the next thing evicted. Its translation
+ * goes, so touching it again takes it back off the queue.
+ */
+static
+void
+dropbehind(struct addrspace *as, vaddr_t vaddr)
+{
+	pte_t *table = as->uberArray[VADDR_TO_UBERINDEX(vaddr)];
+
+	if(table == NULL)
+		return;
+	spinlock_acquire(&spinlkcore);
+	pte_t pte = table[VADDR_TO_SUBINDEX(vaddr)];
+	if((pte & (VPAGE_INMEMORY|VPAGE_BUSY)) == VPAGE_INMEMORY)
+	{
+		index_t index = PTE_FRAME(pte);
+		struct memorypage *frame = &g_coremap.physicalpages[index];
+		if(frame->refcount == 1 && !frame->busy && !frame->dropbehind && !frame->queued)
+		{
+			frame->referenced = false;
+			frame->dropbehind = true;
+			hwpt_clear(as, vaddr);
+			tlbinvalidate(as, vaddr);
+			if(g_coremap.dropqlen == DROPQ_SIZE)
+			{
+				//forget the oldest
+				g_coremap.physicalpages[g_coremap.dropq[g_coremap.dropqhead]].dropbehind = false;
+				g_coremap.dropqhead = (g_coremap.dropqhead + 1) % DROPQ_SIZE;
+				g_coremap.dropqlen--;
+			}
+			g_coremap.dropq[(g_coremap.dropqhead + g_coremap.dropqlen) % DROPQ_SIZE] = index;
+			g_coremap.dropqlen++;
+		}
+	}
+	spinlock_release(&spinlkcore);
+}
+
+/*
+ * MADV_SEQUENTIAL: page VADDR of SEG was just faulted in. Read the
+ * file pages after it now, as long as memory is free (swap readahead
+ * takes care of pages in swap), and give up the page SEQ_WINDOW
+ * behind it. Caller holds as_lock.
+ */
+static
+void
+sequential(struct addrspace *as, struct segment *seg, vaddr_t vaddr)
+{
+	vaddr_t end = (seg->startaddress & PAGE_FRAME) + seg->npages * PAGE_SIZE;
+
+	for(unsigned k = 1; k <= SEQ_WINDOW; k++)
+	{
+		vaddr_t next = vaddr + k * PAGE_SIZE;
+		pte_t *table = as->uberArray[VADDR_TO_UBERINDEX(next)];
+
+		if(next >= end || iszerofill(seg, next) || g_coremap.nfreepages <= g_coremap.lowater)
+			break;
+		if(table != NULL && table[VADDR_TO_SUBINDEX(next)] != VPAGE_UNINIT)
+			continue;	//already in, or in swap
+		if(vm_handlefault(as, VM_FAULT_READ, next, false))
+			break;
+		table = as->uberArray[VADDR_TO_UBERINDEX(next)];
+		spinlock_acquire(&spinlkcore);
+		pte_t pte = table[VADDR_TO_SUBINDEX(next)];
+		if((pte & VPAGE_INMEMORY) != 0 && g_coremap.physicalpages[PTE_FRAME(pte)].refcount == 1)
+		{
+			//not used yet, let the clock take it back if nobody wants it
+			g_coremap.physicalpages[PTE_FRAME(pte)].prefetched = true;
+			g_coremap.physicalpages[PTE_FRAME(pte)].referenced = false;
+		}
+		spinlock_release(&spinlkcore);
+		g_coremap.nseqreads++;
+	}
+	if(vaddr >= (seg->startaddress & PAGE_FRAME) + SEQ_WINDOW * PAGE_SIZE)
+		dropbehind(as, vaddr - SEQ_WINDOW * PAGE_SIZE);
+}
+
+/*
+ * Handle a fault on FAULTADDRESS in AS. Unless MAP, the page is only
+ * brought into memory (prefaulting), with no translation loaded.
+ */
+static
+int
+vm_handlefault(struct addrspace *as, int faulttype, vaddr_t faultaddress, bool map)
+{
+	paddr_t paddr;
+	int uberIndex=VADDR_TO_UBERINDEX(faultaddress);
+	int subIndex=VADDR_TO_SUBINDEX(faultaddress);
+
+	struct segment *seg = as_findregion(as, faultaddress);
+	if(seg == NULL)
+		return EFAULT;
+	if(seg == as->as_heap && faultaddress >= as->as_heapend)
+		return EFAULT;	//past the break
+	switch (faulttype) {
+	case VM_FAULT_READONLY:
+		if( (seg->permission & 0x2) == 0)
+			return EFAULT;
+		break;
+	case VM_FAULT_READ:
+		if((seg->permission & 0x4) == 0)
+			return EFAULT;
+		break;
+	case VM_FAULT_WRITE:
+		if((seg->permission & 0x2) == 0)
+			return EFAULT;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	//if control comes here it means its not a segmentation fault
+	//Address translation-> find paddr
+
+	if(seg == as->as_stack && as->as_sttop < faultaddress)
+		as->as_sttop = faultaddress;
+	if(as->uberArray[uberIndex]==NULL)
+	{
+		int err = as_init_uberarray_section(as, uberIndex);
+		if(err)
+			return err;
+	}
+
+	/*
+	 * From here on the frame is pinned, so nobody can evict it
+	 * between us looking at it and loading the translation.
+	 */
+	pte_t *pte = &as->uberArray[uberIndex][subIndex];
+	if(pin_userpage(pte))
+	{
+		//resident
+	}
+	else if((*pte & VPAGE_INSWAP) != 0)	//page needs to be swapped in
+	{
+		unsigned window = g_swapper.rawindow;
+		if(seg->advice == MADV_RANDOM)
+			window = 0;	//neighbours are no more likely than anything else
+		else if(seg->advice == MADV_SEQUENTIAL)
+			window = SWAP_MAXBATCH - 1;
+		int err = swapin(as, uberIndex, subIndex, window);
+		if(err)
+			return err;
+	}
+	else if(faulttype == VM_FAULT_READ && iszerofill(seg, faultaddress) && seg->anon == NULL)	//another sharer may have written it
+	{
+		//never written: read the zero page until the first write
+		*pte = VPAGE_ZEROFILL;
+		g_coremap.nzeroreads++;
+		if(map)
+			tlbload(as, faultaddress, g_coremap.zeroframe * PAGE_SIZE, false);
+		return 0;
+	}
+	else if(seg->anon != NULL || (seg->vn != NULL && ((seg->permission & 0x2) == 0 || (seg->flags & SEG_SHARED) != 0)))	//text or a shared mapping, share it
+	{
+		if(*pte == VPAGE_ZEROFILL)
+			zerofill_drop(as, faultaddress, pte);
+		int err = cachedpagein(as, seg, faultaddress, pte);
+		if(err)
+			return err;
+	}
+	else
+	{
+		index_t index;
+		bool fromfile = false;
+		if(*pte == VPAGE_ZEROFILL)
+			zerofill_drop(as, faultaddress, pte);
+		int err= allocate_userpage(as, uberIndex, subIndex, true, &index);
+		if(err)
+			return err;
+		if(seg->vn != NULL)
+		{
+			err = readfilepage(seg, faultaddress, index, &fromfile);
+			if(err)
+			{
+				free_userpage(index, as);
+				return err;
+			}
+		}
+		spinlock_acquire(&spinlkcore);
+		if(fromfile)
+			g_coremap.physicalpages[index].state = PAGE_CLEAN;	//same as the file, no slot needed
+		PTE_SETFRAME(*pte, index);
+		*pte |= VPAGE_INMEMORY;
+		spinlock_release(&spinlkcore);
+	}
+
+	KASSERT((*pte & VPAGE_INMEMORY) != 0);
+	KASSERT(g_coremap.physicalpages[PTE_FRAME(*pte)].busy);
+
+	bool writable = (seg->permission & 0x2) != 0;
+	if(writable && g_coremap.physicalpages[PTE_FRAME(*pte)].refcount > 1 && (seg->flags & SEG_SHARED) == 0)
+	{
+		if(faulttype == VM_FAULT_READ)
+		{
+			writable = false;	//share it read-only until somebody writes
+		}
+		else
+		{
+			int err = copyonwrite(as, uberIndex, subIndex);
+			if(err)
+			{
+				unpin_userpage(PTE_FRAME(*pte));
+				return err;
+			}
+		}
+	}
+
+	struct memorypage *frame = &g_coremap.physicalpages[PTE_FRAME(*pte)];
+	if(writable && frame->state == PAGE_CLEAN)
+	{
+		if(faulttype == VM_FAULT_READ)
+		{
+			writable = false;	//the copy in swap is still good, keep it that way until a write
+		}
+		else
+		{
+			//first write since swapin (or since a shared page was written back), the copy there is stale
+			frame->state = PAGE_DIRTY;
+			if((*pte & VPAGE_INSWAP) != 0)
+			{
+				swapfree(PTE_SLOT(*pte));
+				*pte &= ~VPAGE_INSWAP;
+			}
+		}
+	}
+	KASSERT(frame->state != PAGE_FREE);
+	KASSERT(frame->as == as || frame->as == NULL || frame->refcount > 1);
+	frame->referenced = true;
+	frame->dropbehind = false;	//not done with it after all
+	if(frame->prefetched)
+	{
+		//readahead paid off, read further next time
+		frame->prefetched = false;
+		g_swapper.nrahits++;
+		if(g_swapper.rawindow < SWAP_MAXBATCH - 1)
+			g_swapper.rawindow++;
+	}
+	if(frame->as == NULL && frame->refcount == 1 && !frame->cached)
+	{
+		//the sharer that owned this frame is gone, it's ours now
+		spinlock_acquire(&spinlkcore);
+		frame->as = as;
+		frame->vpage = faultaddress;
+		if(frame->state == PAGE_CLEAN && (*pte & VPAGE_INSWAP) == 0)
+			frame->state = PAGE_DIRTY;	//the slot it was clean against went with its owner
+		spinlock_release(&spinlkcore);
+	}
+
+	paddr= PAGE_SIZE * PTE_FRAME(*pte);
+	if(map)
+		tlbload(as, faultaddress, paddr, writable);
+	unpin_userpage(PTE_FRAME(*pte));
+	if(map && seg->advice == MADV_SEQUENTIAL)
+		sequential(as, seg, faultaddress);
+	return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	lock_acquire(g_swapper.lk_swapper);
-
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	int err;
 
 	faultaddress &= PAGE_FRAME;
-	int uberIndex=VADDR_TO_UBERINDEX(faultaddress);
-	int subIndex=VADDR_TO_SUBINDEX(faultaddress);
 	as = curthread->t_addrspace;
 	if (as == NULL) {
 
@@ -378,203 +1985,1057 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		// * instead of getting into an infinite faulting loop.
 		return EFAULT;
 	}
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	g_coremap.nfaults++;
+	lock_acquire(as->as_lock);
+	err = vm_handlefault(as, faulttype, faultaddress, true);
+	lock_release(as->as_lock);
+
+	return err;
+}
+
+/*
+ * MADV_WILLNEED: bring page VADDR of AS into memory now if it is in
+ * swap or still in its file, so touching it later is a cheap fault.
+ * Untouched anonymous pages are left for their first fault. The
+ * caller holds as_lock.
+ */
+int
+vm_willneed(struct addrspace *as, vaddr_t vaddr)
+{
+	struct segment *seg = as_findregion(as, vaddr);
+	pte_t *table;
+	int err;
+
+	if(seg == NULL)
+		return EFAULT;
+	table = as->uberArray[VADDR_TO_UBERINDEX(vaddr)];
+	if(table != NULL && (table[VADDR_TO_SUBINDEX(vaddr)] & VPAGE_INMEMORY) != 0)
+		return 0;
+	if((table == NULL || (table[VADDR_TO_SUBINDEX(vaddr)] & VPAGE_INSWAP) == 0) && iszerofill(seg, vaddr))
+		return 0;
+	err = vm_handlefault(as, VM_FAULT_READ, vaddr, false);
+	if(err == 0)
+		g_coremap.nwillneed++;
+	return err;
+}
+
+/*
+ * Throw away NPAGES pages of AS from VADDR (munmap, MADV_DONTNEED):
+ * their translations everywhere, then their frames and swap slots.
+ * Returns how many there were. Caller holds as_lock.
+ */
+unsigned
+vm_unmap(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	unsigned n = 0;
+
+	for(unsigned k = 0; k < npages; k++, vaddr += PAGE_SIZE)
+	{
+		int i = VADDR_TO_UBERINDEX(vaddr);
+		int j = VADDR_TO_SUBINDEX(vaddr);
+		struct tlbshootdown ts;
+
+		if(as->uberArray[i] == NULL || as->uberArray[i][j] == VPAGE_UNINIT)
+			continue;
+		hwpt_clear(as, vaddr);
+		ts.ts_addrspace = as;
+		ts.ts_vaddr = vaddr;
+		vm_tlbshootdown(&ts);
+		ipi_tlbshootdown_broadcast(&ts);
+		free_virtualpage(as, i, j);
+		n++;
+	}
+	return n;
+}
+
+/* A new shared anonymous object of NPAGES zeroed pages, with one reference. */
+struct anonobj *
+vm_anon_create(uint32_t npages)
+{
+	struct anonobj *obj;
+
+	obj = kmalloc(sizeof(struct anonobj));
+	if(obj == NULL)
+		return NULL;
+	obj->slots = kmalloc(npages * sizeof(index_t));
+	if(obj->slots == NULL)
+	{
+		kfree(obj);
+		return NULL;
+	}
+	for(uint32_t k = 0; k < npages; k++)
+		obj->slots[k] = ANON_NOSLOT;
+	obj->refcount = 1;
+	obj->npages = npages;
+	return obj;
+}
+
+/* Another region uses OBJ (fork, or munmap splitting a region in two). */
+void
+vm_anon_incref(struct anonobj *obj)
+{
+	spinlock_acquire(&spinlkcore);
+	KASSERT(obj->refcount > 0);
+	obj->refcount++;
+	spinlock_release(&spinlkcore);
+}
+
+/*
+ * A region using OBJ has gone, after unmapping its pages. When the
+ * last one goes, nobody can fault its pages in again, so its frames
+ * come out of the page cache and its swap slots are given back. A
+ * frame the pageout daemon is writing out is waited for.
+ */
+void
+vm_anon_decref(struct anonobj *obj)
+{
+	spinlock_acquire(&spinlkcore);
+	KASSERT(obj->refcount > 0);
+	obj->refcount--;
+	if(obj->refcount > 0)
+	{
+		spinlock_release(&spinlkcore);
+		return;
+	}
+	for(unsigned bucket = 0; bucket < PAGECACHE_SIZE; bucket++)
+	{
+		index_t i = pagecache[bucket];
+		while(i != COREMAP_NONE)
+		{
+			struct memorypage *frame = &g_coremap.physicalpages[i];
+			if(frame->cacheanon != obj)
+			{
+				i = frame->nextcached;
+				continue;
+			}
+			if(frame->busy)
+			{
+				vm_wait();	//the chain may change meanwhile, so start over
+				i = pagecache[bucket];
+				continue;
+			}
+			KASSERT(frame->refcount == 1 && frame->rmap == NULL);
+			index_t next = frame->nextcached;
+			pagecache_remove(i);
+			frame->refcount = 0;
+			frame->numallocations = 0;
+			frame->state = PAGE_FREE;
+			frame->as = NULL;
+			buddy_free(i, 0);
+			i = next;
+		}
+	}
+	spinlock_release(&spinlkcore);
+
+	for(uint32_t k = 0; k < obj->npages; k++)
+	{
+		if(obj->slots[k] != ANON_NOSLOT)
+			swapfree(obj->slots[k]);
+	}
+	kfree(obj->slots);
+	kfree(obj);
+}
+void
+vm_printstats(void)
+{
+	uint32_t nblocks[COREMAP_MAXORDER + 1];
+	uint32_t nfree, largest = 0;
+	uint32_t nmultialloc, nmultievict;
+
+	spinlock_acquire(&spinlkcore);
+	for(int order = 0; order <= COREMAP_MAXORDER; order++)
+	{
+		nblocks[order] = 0;
+		for(index_t i = g_coremap.freeheads[order]; i != COREMAP_NONE; i = g_coremap.physicalpages[i].nextfree)
+			nblocks[order]++;
+		if(nblocks[order] > 0)
+			largest = 1 << order;
+	}
+	nfree = g_coremap.nfreepages;
+	nmultialloc = g_coremap.nmultialloc;
+	nmultievict = g_coremap.nmultievict;
+	spinlock_release(&spinlkcore);
+
+	kprintf("coremap: %u frames, %u free\n", (unsigned)g_coremap.numpages, nfree);
+	kprintf("free blocks by order:");
+	for(int order = 0; order <= COREMAP_MAXORDER; order++)
+	{
+		kprintf(" %u", nblocks[order]);
+	}
+	kprintf("\n");
+	/* fragmentation = share of free memory outside the largest free block */
+	kprintf("largest free block %u pages, fragmentation %u%%\n", largest,
+		nfree == 0 ? 0 : 100 - (100 * largest) / nfree);
+	kprintf("multi-page allocations: %u, needing eviction: %u\n", nmultialloc, nmultievict);
+	kprintf("replacement policy: %s\n", g_coremap.policy == VM_EVICT_CLOCK ? "clock" : "fifo");
+	kprintf("asids: %u activations, %u asids handed out, %u rollover flushes\n",
+		g_coremap.nactivations, g_coremap.nasids, g_coremap.nasidflushes);
+	kprintf("tlb: %u misses taken by vm_fault, %u hardware page tables\n",
+		g_coremap.nfaults, g_coremap.nhwpttables);
+	kprintf("evictions: %u (%u written to swap), refaults: %u\n",
+		g_coremap.nevictions, g_coremap.nwritebacks, g_coremap.nrefaults);
+	kprintf("file pages: %u read on demand, %u dropped on eviction, %u written back\n",
+		g_coremap.nfilereads, g_coremap.ndiscards, g_coremap.nfilewrites);
+	kprintf("text cache: %u frames, %u hits\n", g_coremap.ncached, g_coremap.ncachehits);
+	kprintf("madvise: %u pages read ahead, %u dropped behind, %u willneed, %u dontneed\n",
+		g_coremap.nseqreads, g_coremap.ndropbehind, g_coremap.nwillneed, g_coremap.ndontneed);
+	kprintf("zero page: %u read faults, %u later written\n",
+		g_coremap.nzeroreads, g_coremap.nzerowrites);
+	kprintf("zero pool: %u of %u frames, %u hits, %u misses (%u%%), %u zeroed while idle\n",
+		g_coremap.nzeropool, g_coremap.zeropooltarget, g_coremap.nzerohits, g_coremap.nzeromisses,
+		g_coremap.nzerohits + g_coremap.nzeromisses == 0 ? 0 :
+		100 * g_coremap.nzerohits / (g_coremap.nzerohits + g_coremap.nzeromisses),
+		g_coremap.nzeroidle);
+	kprintf("pageout: watermarks %u/%u, %u pages cleaned, %u reclaimed clean, %u queued\n",
+		g_coremap.lowater, g_coremap.hiwater, g_coremap.npageouts,
+		g_coremap.ncleanreclaims, g_coremap.cleanqlen);
+	kprintf("swap: %u of %u slots in use, peak %u\n",
+		g_swapper.slotsinuse, g_swapper.nslots, g_swapper.maxslotsinuse);
+	kprintf("swap writes: %u carrying %u pages\n",
+		g_swapper.nclusterwrites, g_swapper.nclusterpages);
+	kprintf("readahead: window %u, %u pages read ahead, %u used, %u evicted unused\n",
+		g_swapper.rawindow, g_swapper.nprefetched, g_swapper.nrahits, g_swapper.nrawasted);
+	for(unsigned d = 0; d < g_swapper.ndevs; d++)
+	{
+		struct swapdev *sd = &g_swapper.devs[d];
+		uint32_t used = 0;
+
+		spinlock_acquire(&spinlkswap);
+		for(uint32_t slot = d * SWAP_STRIPE; slot < g_swapper.nslots; slot += SWAP_STRIPE * g_swapper.ndevs)
+		{
+			for(uint32_t j = slot; j < slot + SWAP_STRIPE && j < g_swapper.nslots; j++)
+			{
+				if(bitmap_isset(g_swapper.slotmap, j))
+					used++;
+			}
+		}
+		spinlock_release(&spinlkswap);
+		kprintf("  %s: %u pages, %u in use, %u reads, %u writes\n",
+			sd->name, sd->npages, used, sd->nreads, sd->nwrites);
+	}
+}
+
+void dumpcoremap(void)
+{
+	for(uint32_t i=0; i<g_coremap.numpages; i++)
+	{
+		kprintf("%d", g_coremap.physicalpages[i].state);
+
+	}
+	kprintf("\n");
+}
+
+int
+vm_setpolicy(const char *name)
+{
+	if(!strcmp(name, "fifo"))
+		g_coremap.policy = VM_EVICT_FIFO;
+	else if(!strcmp(name, "clock"))
+		g_coremap.policy = VM_EVICT_CLOCK;
+	else
+		return EINVAL;
+	return 0;
+}
+
+/*
+ * Drop this CPU's translation for VADDR in AS, if it has one. Other
+ * CPUs may keep theirs; for the reference bit this is close enough.
+ */
+static
+void
+tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	vm_tlbshootdown(&ts);
+}
+
+static
+int
+chooseframe_fifo(index_t *retval)
+{
+	for(index_t i = (g_coremap.swapcounter + 1)%g_coremap.numpages ; i!= g_coremap.swapcounter; i=(i+1)%g_coremap.numpages)
+	{
+		if(isevictable(i))
+		{
+			g_coremap.swapcounter = i;
+			//			struct tlbshootdown ts;
+			*retval = i;
+			return 0;
+		}
+	}
+	return ENOMEM;	//nothing we can evict
+}
+
+/*
+ * Two-handed clock. The front hand clears the referenced bit (and the
+ * TLB entry) of each frame it passes; the back hand, a quarter of the
+ * coremap behind, takes the first frame that hasn't been touched since.
+ */
+static
+int
+chooseframe_clock(index_t *retval)
+{
+	uint32_t n = g_coremap.numpages;
+
+	for(uint32_t steps = 0; steps < 2 * n; steps++)
+	{
+		index_t front = g_coremap.clockfront = (g_coremap.clockfront + 1) % n;
+		if(isevictable(front) && g_coremap.physicalpages[front].referenced)
+		{
+			struct memorypage *frame = &g_coremap.physicalpages[front];
+			frame->referenced = false;
+			if(!frame->cached)
+			{
+				hwpt_clear(frame->as, frame->vpage);
+				tlbinvalidate(frame->as, frame->vpage);
+			}
+			for(struct rmap *rm = frame->cached ? frame->rmap : NULL; rm != NULL; rm = rm->next)
+			{
+				hwpt_clear(rm->as, rm->vaddr);
+				tlbinvalidate(rm->as, rm->vaddr);
+			}
+		}
+
+		index_t back = g_coremap.swapcounter = (g_coremap.swapcounter + 1) % n;
+		if(isevictable(back) && !g_coremap.physicalpages[back].referenced)
+		{
+			*retval = back;
+			return 0;
+		}
+	}
+	//everything keeps getting referenced, just take the next one
+	return chooseframe_fifo(retval);
+}
+
+/* Choose a victim and claim it. Caller holds spinlkcore. */
+static
+int
+pickvictim(index_t *retval)
+{
+	int err;
+
+	if(dropq_pop(retval))
+	{
+		//a sequential scan is done with it, no need to ask the policy
+		claimframe(*retval);
+		return 0;
+	}
+	if(g_coremap.policy == VM_EVICT_CLOCK)
+		err = chooseframe_clock(retval);
+	else
+		err = chooseframe_fifo(retval);
+	if(err)
+		return err;
+	claimframe(*retval);
+	return 0;
+}
+
+/*
+ * Choose and claim a victim for swapout. If everything evictable is
+ * pinned right now we wait for a pin to go; with nothing evictable at
+ * all we are out of memory.
+ */
+int chooseframetoevict(index_t *retval)
+{
+	spinlock_acquire(&spinlkcore);
+	while(pickvictim(retval))
+	{
+		bool anybusy = false;
+		for(uint32_t i = 0; i < g_coremap.numpages && !anybusy; i++)
+			anybusy = g_coremap.physicalpages[i].busy;
+		if(!anybusy)
+			panic("Out of memory"); //no free page;
+		vm_wait();
+	}
+	spinlock_release(&spinlkcore);
+	return 0;
+}
+
+/*
+ * Can page SUBINDEX of AS go out in the same swap write as its
+ * neighbour? Only resident, dirty, unshared pages with no slot yet.
+ * If so it is claimed along with the victim.
+ */
+static
+bool
+clusterable(struct addrspace *as, int uberindex, int subindex)
+{
+	bool ok = false;
+
+	spinlock_acquire(&spinlkcore);
+	pte_t pte = as->uberArray[uberindex][subindex];
+	if((pte & (VPAGE_INMEMORY|VPAGE_INSWAP|VPAGE_BUSY)) == VPAGE_INMEMORY)
+	{
+		struct memorypage *frame = &g_coremap.physicalpages[PTE_FRAME(pte)];
+		ok = frame->state == PAGE_DIRTY && frame->as == as && claimframe(PTE_FRAME(pte));
+	}
+	spinlock_release(&spinlkcore);
+	return ok;
+}
+
+/*
+ * Write a dirty shared mapping page, which the caller has claimed,
+ * back to its file. Only the part of the page the file still covers is
+ * written; mappings never make a file longer.
+ */
+static
+int
+writefilepage(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	KASSERT(frame->cached && frame->busy);
+	frame_shootdown(index);
+	err = VOP_STAT(frame->cachevn, &st);
+	if(err)
+		return err;
+	if(st.st_size > frame->cacheoff)
+	{
+		off_t len = st.st_size - frame->cacheoff;
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(index * PAGE_SIZE), len < PAGE_SIZE ? len : PAGE_SIZE,
+			frame->cacheoff, UIO_WRITE);
+		err = VOP_WRITE(frame->cachevn, &ku);
+		if(err)
+			return err;
+		g_coremap.nfilewrites++;
+	}
+	spinlock_acquire(&spinlkcore);
+	frame->state = PAGE_CLEAN;
+	spinlock_release(&spinlkcore);
+	return 0;
+}
+
+/*
+ * Write a dirty shared anonymous page, which the caller has claimed,
+ * to its object's swap slot, giving it one the first time. The slot
+ * stays the page's until the object goes.
+ */
+static
+int
+writeanonpage(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	struct anonobj *obj = frame->cacheanon;
+	index_t *slotp = &obj->slots[frame->cacheoff / PAGE_SIZE];
+	index_t slot = *slotp;
+	int err;
+
+	KASSERT(frame->cached && frame->busy);
+	frame_shootdown(index);
+	if(slot == ANON_NOSLOT)
+		slot = findfreeswapoffset(NULL);
+	err = swaprun(&index, 1, slot, UIO_WRITE);
+	if(err)
+	{
+		if(*slotp == ANON_NOSLOT)
+			swapfree(slot);
+		return err;
+	}
+	spinlock_acquire(&spinlkcore);
+	*slotp = slot;
+	frame->state = PAGE_CLEAN;
+	spinlock_release(&spinlkcore);
+	return 0;
+}
+
+/*
+ * Write every dirty shared mapping page of VN back to it (fsync, and
+ * munmap and exit before they drop their mappings). A page somebody
+ * has pinned is waited for, so nothing written before we started is
+ * missed. Returns the last error, if any.
+ */
+int
+vm_syncfile(struct vnode *vn)
+{
+	int result = 0;
+
+	for(unsigned bucket = 0; bucket < PAGECACHE_SIZE; bucket++)
+	{
+		for(;;)
+		{
+			index_t i;
+			bool waited = false;
+
+			spinlock_acquire(&spinlkcore);
+			for(i = pagecache[bucket]; i != COREMAP_NONE; i = g_coremap.physicalpages[i].nextcached)
+			{
+				struct memorypage *frame = &g_coremap.physicalpages[i];
+				if(frame->cachevn == vn && frame->state == PAGE_DIRTY)
+				{
+					if(!claimframe(i))
+					{
+						vm_wait();	//busy; the chain may change meanwhile, so start over
+						waited = true;
+					}
+					break;
+				}
+			}
+			spinlock_release(&spinlkcore);
+			if(waited)
+				continue;
+			if(i == COREMAP_NONE)
+				break;	//this bucket is clean
+
+			int err = writefilepage(i);
+			unclaimframe(i);
+			if(err)
+			{
+				result = err;
+				break;	//it stays dirty, don't spin on it
+			}
+		}
+	}
+	return result;
+}
 
+/*
+ * Write a dirty user frame, which the caller has claimed, to swap but
+ * leave it mapped. Its translations are dropped so the next access
+ * waits for the write and a later write faults and marks it dirty
+ * again. Dirty neighbours in the address space go along in the same
+ * write, into the slots next to it; they stay mapped too and are
+ * queued for the allocators as they are now clean. A shared mapping
+ * page goes to its file instead.
+ */
+static
+int
+cleanpage(index_t index)
+{
+	struct memorypage *frame = &g_coremap.physicalpages[index];
+	if(frame->cached && frame->cachevn != NULL)
+		return writefilepage(index);	//shared file page, its file is its swap
+	if(frame->cached)
+		return writeanonpage(index);
+	struct addrspace *as = frame->as;
+	int uberindex = VADDR_TO_UBERINDEX(frame->vpage);
+	int subindex = VADDR_TO_SUBINDEX(frame->vpage);
+	pte_t *pte = &as->uberArray[uberindex][subindex];
+	bool hadslot = (*pte & VPAGE_INSWAP) != 0;
+	index_t frames[SWAP_MAXBATCH];
+	index_t slot;
+	int first = subindex, last = subindex;
+	unsigned n;
+	int err;
 
-	if( (as->uberArray[uberIndex]== NULL || as->uberArray[uberIndex][subIndex] == NULL) && uberIndex < STACK_MAX && !(faultaddress >= as->as_heapbase && faultaddress <= as->as_heapend))
-		return EFAULT;
-	if(uberIndex < STACK_MAX && !(faultaddress >= as->as_heapbase && faultaddress <= as->as_heapend))
+	KASSERT(frame->state == PAGE_DIRTY);
+	if(hadslot)
 	{
-		switch (faulttype) {
-		case VM_FAULT_READONLY:
-			if( (as->uberArray[uberIndex][subIndex]->permission & 0x2) == 0)
-				return EFAULT;
-			break;
-		case VM_FAULT_READ:
-			if((as->uberArray[uberIndex][subIndex]->permission & 0x4) == 0)
-				return EFAULT;
-			break;
-		case VM_FAULT_WRITE:
-			if((as->uberArray[uberIndex][subIndex]->permission & 0x2) == 0)
-				return EFAULT;
-			break;
-		default:
-			return EINVAL;
+		//already has a slot (shared copy-on-write page), rewrite it alone
+		n = 1;
+		slot = PTE_SLOT(*pte);
+	}
+	else
+	{
+		while(first > 0 && last - first + 1 < SWAP_MAXBATCH && clusterable(as, uberindex, first - 1))
+			first--;
+		while(last < NUM_SUBPAGES - 1 && last - first + 1 < SWAP_MAXBATCH && clusterable(as, uberindex, last + 1))
+			last++;
+		n = findfreeswaprun(as, last - first + 1, &slot);
+		while(last - first + 1 > (int)n)	//not that many adjacent slots, trim the run
+		{
+			if(first < subindex)
+				unclaimframe(PTE_FRAME(as->uberArray[uberindex][first++]));
+			else
+				unclaimframe(PTE_FRAME(as->uberArray[uberindex][last--]));
 		}
 	}
 
+	for(int i = first; i <= last; i++)
+	{
+		struct tlbshootdown ts;
 
+		frames[i - first] = PTE_FRAME(as->uberArray[uberindex][i]);
+		ts.ts_addrspace = as;
+		ts.ts_vaddr = INDECES_TO_VADDR(uberindex, i);
+		vm_tlbshootdown(&ts);
+		ipi_tlbshootdown_broadcast(&ts);
+	}
 
-	//if control comes here it means its not a segmentation fault
-	//Address translation-> find paddr
-
-	if(uberIndex >= STACK_MAX)
+	err = swaprun(frames, n, slot, UIO_WRITE);
+	if(err)
 	{
-		//if last 1024 pages just assume its stack.... for now?
-		if(as->uberArray[uberIndex]==NULL)
+		if(!hadslot)
 		{
-			as_init_uberarray_section(as, uberIndex);
+			for(unsigned k = 0; k < n; k++)
+				swapfree(slot + k);
 		}
-		if(as->uberArray[uberIndex][subIndex] == NULL)
+		for(int i = first; i <= last; i++)
 		{
-			as->uberArray[uberIndex][subIndex] = as_init_virtualpage();
-			as->uberArray[uberIndex][subIndex]->permission = 0x6;
-			index_t index;
-			int err= allocate_userpage(as, uberIndex, subIndex, &index);
-			if(err)
-				return err;
-			as->uberArray[uberIndex][subIndex]->coremapindex = index;
-			as->uberArray[uberIndex][subIndex]->status |= VPAGE_INMEMORY;
+			if(i != subindex)
+				unclaimframe(frames[i - first]);
 		}
-		if(as->as_sttop < faultaddress)
-			as->as_sttop = faultaddress;
+		return err;
 	}
-	else if(faultaddress >= as->as_heapbase && faultaddress <= as->as_heapend)
+	g_swapper.nclusterwrites++;
+	g_swapper.nclusterpages += n;
+
+	spinlock_acquire(&spinlkcore);
+	for(int i = first; i <= last; i++)
 	{
-		if(as->uberArray[uberIndex]==NULL)
-		{
-			as_init_uberarray_section(as, uberIndex);
-		}
-		if(as->uberArray[uberIndex][subIndex] == NULL)
-		{
-			as->uberArray[uberIndex][subIndex] = as_init_virtualpage();
-			as->uberArray[uberIndex][subIndex]->permission = 0x6;
-			index_t index;
-			int err= allocate_userpage(as, uberIndex, subIndex, &index);
-			if(err)
-				return err;
-			as->uberArray[uberIndex][subIndex]->coremapindex = index;
-			as->uberArray[uberIndex][subIndex]->status |= VPAGE_INMEMORY;
-		}
+		pte_t *p = &as->uberArray[uberindex][i];
+		g_coremap.physicalpages[PTE_FRAME(*p)].state = PAGE_CLEAN;
+		PTE_SETSLOT(*p, slot + (i - first));
+		*p |= VPAGE_INSWAP;
 	}
-	else if((as->uberArray[uberIndex][subIndex]->status & VPAGE_INMEMORY)==0 && (as->uberArray[uberIndex][subIndex]->status & VPAGE_INSWAP)==0)
+	spinlock_release(&spinlkcore);
+	for(int i = first; i <= last; i++)
 	{
-		KASSERT(as->uberArray[uberIndex] !=NULL );
-		KASSERT(as->uberArray[uberIndex][subIndex] != NULL);
-		index_t index;
-		int err= allocate_userpage(as, uberIndex, subIndex, &index);
-		if(err)
-			return err;
-		as->uberArray[uberIndex][subIndex]->coremapindex = index;
-		as->uberArray[uberIndex][subIndex]->status |= VPAGE_INMEMORY;
+		if(i != subindex)
+		{
+			unclaimframe(frames[i - first]);
+			cleanq_push(frames[i - first]);
+		}
 	}
-	if( (as->uberArray[uberIndex][subIndex]->status & VPAGE_INMEMORY) == 0 && (as->uberArray[uberIndex][subIndex]->status & VPAGE_INSWAP) != 0)	//page needs to be swapped in
+	return 0;
+}
+
+/* Frames allocators could have right now without any I/O. */
+static
+uint32_t
+reclaimable(void)
+{
+	uint32_t n;
+
+	spinlock_acquire(&spinlkcore);
+	n = g_coremap.nfreepages;
+	for(uint32_t k = 0; k < g_coremap.cleanqlen; k++)
 	{
-		int err = swapin(as, uberIndex, subIndex);
-		if(err)
-			return err;
-		as->uberArray[uberIndex][subIndex]->status |= VPAGE_INMEMORY;
+		index_t i = g_coremap.cleanq[(g_coremap.cleanqhead + k) % g_coremap.numpages];
+		if(g_coremap.physicalpages[i].queued && g_coremap.physicalpages[i].state == PAGE_CLEAN)
+			n++;
 	}
+	spinlock_release(&spinlkcore);
+	return n;
+}
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
 
-	//we will check if the virtual page is in coremap or not....right now we are assuming it is in coremap.
+	for(;;)
+	{
+		P(sem_pageout);
+		//spare objects in the kernel's caches go before anybody's pages do
+		kmem_cache_reap();
+		while(reclaimable() < g_coremap.hiwater)
+		{
+			index_t victim;
 
-	KASSERT((as->uberArray[uberIndex][subIndex]->status & VPAGE_INMEMORY) != 0);
-	paddr= PAGE_SIZE * as->uberArray[uberIndex][subIndex]->coremapindex;
+			spinlock_acquire(&spinlkcore);
+			int err = pickvictim(&victim);
+			spinlock_release(&spinlkcore);
+			if(err)
+				break;	//nothing left to evict
+			if(g_coremap.physicalpages[victim].queued)
+			{
+				//the hand came all the way round
+				unclaimframe(victim);
+				break;
+			}
+			if(g_coremap.physicalpages[victim].state == PAGE_DIRTY)
+			{
+				err = cleanpage(victim);
+				if(err == 0)
+					g_coremap.npageouts++;
+			}
+			unclaimframe(victim);
+			if(err)
+				break;
+			cleanq_push(victim);
+		}
+		spinlock_acquire(&spinlkcore);
+		g_coremap.pageoutwanted = false;
+		spinlock_release(&spinlkcore);
+	}
+}
 
+/*
+ * The zeroing thread tops the pool up to zeropooltarget frames, but
+ * only while this CPU has nothing else to run and there is plenty of
+ * free memory, so page faults find their frames already zeroed.
+ */
+static
+void
+zero_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
 
-	KASSERT(g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex].state != PAGE_FREE);
-	//if(g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex].as != as && g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex].as != NULL)
-	KASSERT(g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex].as == as || g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex].as == NULL);
-	//KASSERT(g_coremap.physicalpages[as->uberArray[uberIndex][subIndex]->coremapindex]);
-	//KASSERT((paddr & PAGE_FRAME) == paddr);
+	for(;;)
+	{
+		P(sem_zero);
+		for(;;)
+		{
+			if(curcpu->c_runqueue.tl_count > 0)
+			{
+				thread_yield();	//somebody has real work
+				continue;
+			}
+			spinlock_acquire(&spinlkcore);
+			if(g_coremap.nzeropool >= g_coremap.zeropooltarget || g_coremap.nfreepages <= g_coremap.hiwater)
+			{
+				g_coremap.zerowanted = false;
+				spinlock_release(&spinlkcore);
+				break;
+			}
+			index_t i = buddy_alloc(0);
+			g_coremap.physicalpages[i].numallocations = 1;
+			g_coremap.physicalpages[i].state = PAGE_FIXED;
+			spinlock_release(&spinlkcore);
 
-	// Disable interrupts on this CPU while frobbing the TLB.
-	spl = splhigh();
+			page_zero(PADDR_TO_KVADDR(i * PAGE_SIZE));
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+			spinlock_acquire(&spinlkcore);
+			if(g_coremap.nzeropool < g_coremap.zeropooltarget)
+			{
+				g_coremap.zeropool[g_coremap.nzeropool++] = i;
+				g_coremap.nzeroidle++;
+			}
+			else
+			{
+				//the target went down while we worked
+				g_coremap.physicalpages[i].state = PAGE_FREE;
+				g_coremap.physicalpages[i].numallocations = 0;
+				buddy_free(i, 0);
+			}
+			spinlock_release(&spinlkcore);
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		lock_release(g_swapper.lk_swapper);
-
-		return 0;
 	}
+}
 
-	as->tlbclock = (as->tlbclock + 1) % NUM_TLB;
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-	tlb_write(ehi, elo, as->tlbclock);
-	splx(spl);
-	lock_release(g_swapper.lk_swapper);
+/* Keep NFRAMES pre-zeroed frames from now on (at most ZEROPOOL_MAX). */
+int
+vm_setzeropool(unsigned nframes)
+{
+	bool wake;
 
+	if(nframes > ZEROPOOL_MAX)
+		return EINVAL;
+	spinlock_acquire(&spinlkcore);
+	g_coremap.zeropooltarget = nframes;
+	while(g_coremap.nzeropool > nframes)
+	{
+		index_t i = g_coremap.zeropool[--g_coremap.nzeropool];
+		g_coremap.physicalpages[i].state = PAGE_FREE;
+		g_coremap.physicalpages[i].numallocations = 0;
+		buddy_free(i, 0);
+	}
+	wake = zeropool_check();
+	spinlock_release(&spinlkcore);
+	if(wake)
+		V(sem_zero);
 	return 0;
-	//kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	//splx(spl);
-	//return EFAULT;
+}
+
+void
+vm_pageout_bootstrap(void)
+{
+	int err;
 
+	g_coremap.cleanq = kmalloc(g_coremap.numpages * sizeof(index_t));
+	if(g_coremap.cleanq == NULL)
+		panic("vm_pageout_bootstrap: out of memory\n");
+	sem_pageout = sem_create("pageout", 0);
+	if(sem_pageout == NULL)
+		panic("vm_pageout_bootstrap: out of memory\n");
+	if(g_swapper.swapfile == NULL && g_swapper.ndevs == 0)
+	{
+		//open it now rather than racing to open it in the middle of an eviction
+		err = vfs_open((char*)"os161.swap",O_RDWR|O_CREAT|O_TRUNC, 0, &g_swapper.swapfile);
+		if(err)
+			kprintf("vm: cannot open os161.swap yet: %s\n", strerror(err));
+	}
+	err = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if(err)
+		panic("vm_pageout_bootstrap: thread_fork failed: %s\n", strerror(err));
 
+	sem_zero = sem_create("zeropool", 0);
+	if(sem_zero == NULL)
+		panic("vm_pageout_bootstrap: out of memory\n");
+	err = thread_fork("pagezero", zero_thread, NULL, 0, NULL);
+	if(err)
+		panic("vm_pageout_bootstrap: thread_fork failed: %s\n", strerror(err));
+	g_coremap.zerowanted = true;
+	V(sem_zero);	//fill the pool to start with
 }
-void dumpcoremap(void)
+
+/*
+ * Allocate a swap slot for a page of AS. We look right after the last
+ * slot the process got, so its pages end up next to each other in the
+ * swap file. A process that has no slots yet starts at the cursor,
+ * which then skips ahead SWAP_CLUSTER slots to leave it room to grow.
+ */
+index_t findfreeswapoffset(struct addrspace *as)
 {
-	for(uint32_t i=0; i<g_coremap.numpages; i++)
-	{
-		kprintf("%d", g_coremap.physicalpages[i].state);
+	index_t slot;
 
-	}
-	kprintf("\n");
+	findfreeswaprun(as, 1, &slot);
+	return slot;
 }
 
-int chooseframetoevict(index_t *retval)
+/*
+ * Same, but try for WANT adjacent slots. Returns how many we got (at
+ * least one), starting at *FIRST.
+ */
+static
+unsigned
+findfreeswaprun(struct addrspace *as, unsigned want, index_t *first)
 {
-	for(index_t i = (g_coremap.swapcounter + 1)%g_coremap.numpages ; i!= g_coremap.swapcounter; i=(i+1)%g_coremap.numpages)
+	uint32_t start;
+
+	spinlock_acquire(&spinlkswap);
+	if(as != NULL && as->as_swaphint >= 0)
+	{
+		start = as->as_swaphint;
+	}
+	else
+	{
+		start = g_swapper.cursor;
+		g_swapper.cursor = (g_swapper.cursor + SWAP_CLUSTER) % g_swapper.nslots;
+	}
+	for(uint32_t i = 0; i < g_swapper.nslots; i++)
 	{
-		if(g_coremap.physicalpages[i].state == PAGE_CLEAN || g_coremap.physicalpages[i].state == PAGE_DIRTY)
+		uint32_t slot = (start + i) % g_swapper.nslots;
+		if(!bitmap_isset(g_swapper.slotmap, slot))
 		{
-			g_coremap.swapcounter = i;
-			//			struct tlbshootdown ts;
-			*retval = i;
-			return 0;
+			unsigned n = 0;
+			while(n < want && slot + n < g_swapper.nslots && !bitmap_isset(g_swapper.slotmap, slot + n))
+			{
+				bitmap_mark(g_swapper.slotmap, slot + n);
+				n++;
+			}
+			g_swapper.slotsinuse += n;
+			if(g_swapper.slotsinuse > g_swapper.maxslotsinuse)
+				g_swapper.maxslotsinuse = g_swapper.slotsinuse;
+			if(as != NULL)
+				as->as_swaphint = (slot + n) % g_swapper.nslots;
+			spinlock_release(&spinlkswap);
+			*first = slot;
+			return n;
 		}
 	}
-	panic("Out of memory"); //no free page;
-	return ENOMEM;
+	spinlock_release(&spinlkswap);
+	panic("Out of swap space");
+	return 0;
 }
 
-index_t findfreeswapoffset()
+void swapfree(index_t swapoffset)
 {
-	off_t retval = g_swapper.fileend;
-	g_swapper.fileend += PAGE_SIZE;
-	return (retval / PAGE_SIZE);
+	spinlock_acquire(&spinlkswap);
+	KASSERT(bitmap_isset(g_swapper.slotmap, swapoffset));
+	bitmap_unmark(g_swapper.slotmap, swapoffset);
+	g_swapper.slotsinuse--;
+	spinlock_release(&spinlkswap);
 }
 
+/* Free a claimed, clean frame; its page now lives only in swap or in its file. */
 void evict(index_t coremapindex)
 {
 	spinlock_acquire(&spinlkcore);
 
 	//KASSERT(g_coremap.physicalpages[coremapindex].state == PAGE_CLEAN);
-	struct addrspace *as = g_coremap.physicalpages[coremapindex].as;
-	int32_t uberindex = VADDR_TO_UBERINDEX(g_coremap.physicalpages[coremapindex].vpage);
-	int32_t subindex = VADDR_TO_SUBINDEX(g_coremap.physicalpages[coremapindex].vpage);
-	as->uberArray[uberindex][subindex]->status &= 0xFFFE;	//set the first bit to 0;
+	KASSERT(g_coremap.physicalpages[coremapindex].busy);
+	if(g_coremap.physicalpages[coremapindex].cached)
+	{
+		//shared: everybody refaults and one of them reads it again, from the file or the object's slot
+		struct rmap *rm = g_coremap.physicalpages[coremapindex].rmap;
+		while(rm != NULL)
+		{
+			struct rmap *next = rm->next;
+			*rmap_pte(rm) = VPAGE_UNINIT;
+			rmap_put(rm);
+			rm = next;
+		}
+		if(g_coremap.physicalpages[coremapindex].cachevn != NULL)
+			g_coremap.ndiscards++;
+		pagecache_remove(coremapindex);
+	}
+	else if((*frame_pte(coremapindex) & VPAGE_INSWAP) != 0)
+	{
+		*frame_pte(coremapindex) &= ~(VPAGE_INMEMORY|VPAGE_BUSY);
+	}
+	else
+	{
+		//clean file page, the next fault reads it from the file again
+		*frame_pte(coremapindex) = VPAGE_UNINIT;
+		g_coremap.ndiscards++;
+	}
+	g_coremap.nevictions++;
+	if(g_coremap.physicalpages[coremapindex].prefetched)
+	{
+		//read ahead for nothing, look less far next time
+		g_coremap.physicalpages[coremapindex].prefetched = false;
+		g_swapper.nrawasted++;
+		g_swapper.rawindow = g_swapper.rawindow > 2 ? g_swapper.rawindow / 2 : 1;
+	}
 	g_coremap.physicalpages[coremapindex].state = PAGE_FREE;
 	g_coremap.physicalpages[coremapindex].as = NULL;
 	g_coremap.physicalpages[coremapindex].numallocations = 0;
-	spinlock_release(&spinlkcore);
+	g_coremap.physicalpages[coremapindex].refcount = 0;
+	g_coremap.physicalpages[coremapindex].busy = false;
+	buddy_free(coremapindex, 0);
+	coremap_unlock_wake();
+}
 
+/*
+ * Add a raw disk to swap space. Only allowed while nothing is in swap,
+ * since adding a disk changes where every slot lives.
+ */
+int
+vm_swapon(const char *devname)
+{
+	struct device *dev;
+	struct swapdev *sd;
+	uint32_t minpages;
+	int err;
+
+	lock_acquire(g_swapper.lk_swapper);
+	if(g_swapper.slotsinuse > 0 || g_swapper.ndevs == SWAP_MAXDEVS)
+	{
+		lock_release(g_swapper.lk_swapper);
+		return EBUSY;
+	}
+	err = vfs_swapon(devname, &dev);
+	if(err)
+	{
+		lock_release(g_swapper.lk_swapper);
+		return err;
+	}
+	if(dev->d_blocksize == 0 || PAGE_SIZE % dev->d_blocksize != 0)
+	{
+		lock_release(g_swapper.lk_swapper);
+		return EINVAL;
+	}
+	err = dev->d_open(dev, O_RDWR);
+	if(err)
+	{
+		lock_release(g_swapper.lk_swapper);
+		return err;
+	}
+
+	sd = &g_swapper.devs[g_swapper.ndevs];
+	sd->name = kstrdup(devname);
+	if(sd->name == NULL)
+	{
+		lock_release(g_swapper.lk_swapper);
+		return ENOMEM;
+	}
+	sd->dev = dev;
+	sd->npages = dev->d_blocks / (PAGE_SIZE / dev->d_blocksize);
+	sd->nreads = 0;
+	sd->nwrites = 0;
+	g_swapper.ndevs++;
+
+	//stripes are the same size on every disk, so the smallest one decides
+	minpages = sd->npages;
+	for(unsigned i = 0; i < g_swapper.ndevs; i++)
+	{
+		if(g_swapper.devs[i].npages < minpages)
+			minpages = g_swapper.devs[i].npages;
+	}
+	minpages = ROUNDDOWN(minpages, SWAP_STRIPE);
+	g_swapper.nslots = minpages * g_swapper.ndevs;
+	if(g_swapper.nslots > SWAP_MAXSLOTS)
+		g_swapper.nslots = SWAP_MAXSLOTS;
+	g_swapper.cursor = 0;
+	KASSERT(g_swapper.nslots > 0);
+
+	kprintf("swap: %s: %u pages, %u slots over %u disk(s)\n", devname,
+		sd->npages, g_swapper.nslots, g_swapper.ndevs);
+	lock_release(g_swapper.lk_swapper);
+	return 0;
 }
 
-int writetoswap(index_t coremapindex, index_t *swapoffset)
+/*
+ * Move NPAGES frames to or from as many adjacent swap slots, either
+ * through the VFS to the swap file or straight to the disks' d_io. The
+ * frames needn't be contiguous; each gets its own iovec, so a run that
+ * stays on one disk is a single I/O.
+ */
+static
+int
+swaprun(index_t *frames, unsigned npages, index_t swapoffset, enum uio_rw rw)
 {
-	if(g_swapper.swapfile == NULL)
+	struct iovec iov[SWAP_MAXBATCH];
+	struct uio ku;
+	unsigned done = 0;
+	int err;
+
+	KASSERT(npages > 0 && npages <= SWAP_MAXBATCH);
+	for(unsigned i = 0; i < npages; i++)
+	{
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(frames[i] * PAGE_SIZE);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	if(g_swapper.ndevs == 0)
+	{
+		if(g_swapper.swapfile == NULL)
+		{
+			err = vfs_open((char*)"os161.swap",O_RDWR|O_CREAT|O_TRUNC, 0, &g_swapper.swapfile);
+			if(err)
+				return err;
+		}
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = npages;
+		ku.uio_offset = (off_t)swapoffset * PAGE_SIZE;
+		ku.uio_resid = npages * PAGE_SIZE;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = rw;
+		ku.uio_space = NULL;
+		if(rw == UIO_READ)
+			return vfs_read(g_swapper.swapfile, &ku);
+		return vfs_write(g_swapper.swapfile, &ku);
+	}
+
+	//one I/O per stripe the run touches
+	while(done < npages)
 	{
-		int err = vfs_open((char*)"os161.swap",O_RDWR|O_CREAT|O_TRUNC, 0, &g_swapper.swapfile);
+		index_t slot = swapoffset + done;
+		KASSERT(slot < g_swapper.nslots);
+		uint32_t stripe = slot / SWAP_STRIPE;
+		struct swapdev *sd = &g_swapper.devs[stripe % g_swapper.ndevs];
+		off_t pos = (off_t)((stripe / g_swapper.ndevs) * SWAP_STRIPE + slot % SWAP_STRIPE) * PAGE_SIZE;
+		unsigned n = SWAP_STRIPE - slot % SWAP_STRIPE;
+		if(n > npages - done)
+			n = npages - done;
+
+		ku.uio_iov = &iov[done];
+		ku.uio_iovcnt = n;
+		ku.uio_offset = pos;
+		ku.uio_resid = n * PAGE_SIZE;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = rw;
+		ku.uio_space = NULL;
+		err = sd->dev->d_io(sd->dev, &ku);
 		if(err)
 			return err;
+		if(rw == UIO_READ)
+			sd->nreads += n;
+		else
+			sd->nwrites += n;
+		done += n;
 	}
+	return 0;
+}
+
+int writetoswap(index_t coremapindex, index_t *swapoffset)
+{
 	//struct addrspace *as = g_coremap.physicalpages[coremapindex].as;
 	//KASSERT(*swapoffset != -1);
-	struct iovec iov;
-	struct uio ku;
-	char *writebuf = (char*) ( PADDR_TO_KVADDR((coremapindex * PAGE_SIZE)));
-	uio_kinit(&iov, &ku, writebuf, PAGE_SIZE, ( (*swapoffset) * PAGE_SIZE), UIO_WRITE);
-	int err = vfs_write(g_swapper.swapfile, &ku);
+	int err = swaprun(&coremapindex, 1, *swapoffset, UIO_WRITE);
 	if(err)
 	{
 		return err;
@@ -582,18 +3043,10 @@ int writetoswap(index_t coremapindex, index_t *swapoffset)
 	g_coremap.physicalpages[coremapindex].state = PAGE_CLEAN;
 	return 0;
 }
-
 int readfromswap(index_t coremapindex, index_t swapoffset)
 {
-	KASSERT(g_swapper.swapfile != NULL);
 	//KASSERT((swapoffset != -1));
-
-	struct iovec iov;
-	struct uio ku;
-	char *readbuf = (char*) ( PADDR_TO_KVADDR( (coremapindex * PAGE_SIZE)));
-	uio_kinit(&iov, &ku, readbuf, PAGE_SIZE, (swapoffset * PAGE_SIZE), UIO_READ);
-
-	int err = vfs_read(g_swapper.swapfile, &ku);
+	int err = swaprun(&coremapindex, 1, swapoffset, UIO_READ);
 	if(err)
 	{
 		return err;
@@ -603,6 +3056,11 @@ int readfromswap(index_t coremapindex, index_t swapoffset)
 	return 0;
 }
 
+/*
+ * Evict a user frame. With ALLOCATE we pick the victim ourselves,
+ * otherwise the caller has already claimed *COREMAPINDEX. No global
+ * lock is held across the write; the page is VPAGE_BUSY meanwhile.
+ */
 int swapout(index_t *coremapindex, bool allocate, struct addrspace* as)
 {
 	int err=0;
@@ -610,29 +3068,22 @@ int swapout(index_t *coremapindex, bool allocate, struct addrspace* as)
 		err = chooseframetoevict(coremapindex);
 	if(err)
 		return ENOMEM;
+	KASSERT(g_coremap.physicalpages[*coremapindex].busy);
 
-	struct addrspace *victim_as = g_coremap.physicalpages[*coremapindex].as;
-	int32_t uberindex = VADDR_TO_UBERINDEX(g_coremap.physicalpages[*coremapindex].vpage);
-	int32_t subindex = VADDR_TO_SUBINDEX(g_coremap.physicalpages[*coremapindex].vpage);
-	struct tlbshootdown ts;
-
-	ts.ts_addrspace = g_coremap.physicalpages[*coremapindex].as;
-	ts.ts_vaddr = g_coremap.physicalpages[*coremapindex].vpage;
-
-	victim_as->uberArray[uberindex][subindex]->status &= 0xFE;	//set the first bit to 0;
-	if(g_coremap.physicalpages[*coremapindex].as == as)
-		vm_tlbshootdown(&ts);
-	ipi_tlbshootdown_broadcast(&ts);
+	(void)as;
+	frame_shootdown(*coremapindex);
 	if(g_coremap.physicalpages[*coremapindex].state == PAGE_DIRTY)
 	{
-		if((victim_as->uberArray[uberindex][subindex]->status & VPAGE_INSWAP) == 0)	//this is the first time this frame is being written to file, so allocate a place in file
+		//first time out, or dirtied since: write it (and its dirty neighbours)
+		err = cleanpage(*coremapindex);
+		if(err)
 		{
-			victim_as->uberArray[uberindex][subindex]->swapfileoffset = findfreeswapoffset();	//repeated twice keep in one place
+			unclaimframe(*coremapindex);
+			return err;
 		}
-		writetoswap(*coremapindex, &(victim_as->uberArray[uberindex][subindex]->swapfileoffset));
-		victim_as->uberArray[uberindex][subindex]->status |= VPAGE_INSWAP;
+		g_coremap.nwritebacks++;
 	}
-	KASSERT(g_coremap.physicalpages[*coremapindex].state == PAGE_CLEAN && (victim_as->uberArray[uberindex][subindex]->status & VPAGE_INSWAP) != 0);
+	KASSERT(g_coremap.physicalpages[*coremapindex].state == PAGE_CLEAN);
 
 	evict(*coremapindex);
 
@@ -640,30 +3091,75 @@ int swapout(index_t *coremapindex, bool allocate, struct addrspace* as)
 	return 0;
 }
 
-int swapin(struct addrspace *as, int uberindex, int subindex)
+/*
+ * Bring a page back from swap. Following pages of the address space
+ * that sit in the next slots come along in the same read, up to WINDOW
+ * of them (the adaptive readahead window, unless madvise said
+ * otherwise), as long as that doesn't take evicting anything.
+ */
+int swapin(struct addrspace *as, int uberindex, int subindex, unsigned window)
 {
-
-	//first try to find a free frame to swap in to.
-	index_t freemem = 0;
+	pte_t *pte = &as->uberArray[uberindex][subindex];
+	index_t frames[SWAP_MAXBATCH];
+	unsigned n;
 	int err;
-	err=allocate_userpage(as, uberindex, subindex, &freemem);
 
+	//first try to find a free frame to swap in to. It comes pinned.
+	err=allocate_userpage(as, uberindex, subindex, false, &frames[0]);
 	if(err)
 		return err;
-	KASSERT( (as->uberArray[uberindex][subindex]->status & VPAGE_INSWAP) != 0);
-	//now we have a  free memory frame read from file
-	err = readfromswap(freemem, as->uberArray[uberindex][subindex]->swapfileoffset);
-	spinlock_acquire(&spinlkcore);
-	g_coremap.physicalpages[freemem].as = as;
-	g_coremap.physicalpages[freemem].numallocations  = 1;
-	g_coremap.physicalpages[freemem].state = PAGE_DIRTY;
-	g_coremap.physicalpages[freemem].vpage = INDECES_TO_VADDR(uberindex,subindex);
-	as->uberArray[uberindex][subindex]->coremapindex = freemem;
-	as->uberArray[uberindex][subindex]->status |= VPAGE_INMEMORY;
-	spinlock_release(&spinlkcore);
+	KASSERT( (*pte & VPAGE_INSWAP) != 0);
+	g_coremap.nrefaults++;
+
+	for(n = 1; n <= window && n < SWAP_MAXBATCH && subindex + n < NUM_SUBPAGES; n++)
+	{
+		pte_t next = as->uberArray[uberindex][subindex + n];
+		if((next & (VPAGE_INMEMORY|VPAGE_INSWAP)) != VPAGE_INSWAP)
+			break;
+		if(PTE_SLOT(next) != PTE_SLOT(*pte) + n || g_coremap.nfreepages <= g_coremap.lowater)
+			break;
+		if(allocate_userpage(as, uberindex, subindex + n, false, &frames[n]))
+			break;
+	}
 
+	//now we have free memory frames, read from file
+	err = swaprun(frames, n, PTE_SLOT(*pte), UIO_READ);
 	if(err)
-		return err;
+	{
+		//just the one we came for then
+		for(unsigned k = 1; k < n; k++)
+			free_userpage(frames[k], as);
+		n = 1;
+		err = swaprun(frames, 1, PTE_SLOT(*pte), UIO_READ);
+		if(err)
+		{
+			free_userpage(frames[0], as);
+			return err;
+		}
+	}
+
+	spinlock_acquire(&spinlkcore);
+	for(unsigned k = 0; k < n; k++)
+	{
+		pte_t *p = &as->uberArray[uberindex][subindex + k];
+		struct memorypage *frame = &g_coremap.physicalpages[frames[k]];
+		frame->as = as;
+		frame->numallocations  = 1;
+		frame->state = PAGE_CLEAN;	//same as its slot until the first write
+		frame->vpage = INDECES_TO_VADDR(uberindex,(subindex + k));
+		if(k > 0)
+		{
+			//not used yet, let the clock take it back if nobody wants it
+			frame->prefetched = true;
+			frame->referenced = false;
+		}
+		PTE_SETFRAME(*p, frames[k]);
+		*p |= VPAGE_INMEMORY;
+		if(k > 0)
+			frame->busy = false;	//the faulting page stays pinned for the caller
+	}
+	coremap_unlock_wake();
+	g_swapper.nprefetched += n - 1;
 
 	return 0;
 }
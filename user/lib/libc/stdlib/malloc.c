@@ -133,6 +133,12 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * A free block at the top of the heap at least this big (header
+ * included) is given back to the kernel by free().
+ */
+#define MTRIMSIZE	(64*1024)
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -475,6 +481,40 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * If the free block mh is the top of the heap and big enough, hand it
+ * back to the kernel by moving the break down to its header. The block
+ * below it, if any, is in use (or it would have been merged) and
+ * becomes the top. If sbrk won't shrink, the block just stays.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t size;
+	void *x;
+
+	if (mh->mh_inuse || M_NEXT(mh) != (struct mheader *)__heaptop) {
+		return;
+	}
+	size = __heaptop - (uintptr_t)mh;
+	if (size < MTRIMSIZE) {
+		return;
+	}
+
+	x = sbrk(-(intptr_t)size);
+	if (x == (void *)-1) {
+		return;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "malloc: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
+	}
+	__heaptop = (uintptr_t)mh;
+}
+
 /*
  * The actual free() implementation.
  */
@@ -530,8 +570,15 @@ free(void *x)
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
 		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			/* merged; mh is gone */
+			mh = mhprev;
+		}
 	}
 
+	/* Give back a big free block at the top of the heap */
+	__malloc_trim(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
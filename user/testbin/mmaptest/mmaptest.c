@@ -0,0 +1,261 @@
+/*
+ * mmaptest.c
+ *
+ *	Exercises mmap and munmap. Writes a file of several pages and
+ *	then checks that:
+ *
+ *	  - a private mapping reads the file, and writing it leaves the
+ *	    file alone;
+ *	  - writes through a shared mapping reach the file, both on
+ *	    fsync and on munmap;
+ *	  - unmapping the middle of a mapping leaves both ends usable;
+ *	  - madvise takes each kind of advice, and MADV_DONTNEED on a
+ *	    private mapping throws away what was written;
+ *	  - anonymous memory starts out zeroed, and a shared anonymous
+ *	    mapping is really shared with a forked child, including pages
+ *	    neither process had touched when it forked.
+ *
+ *	Usage: mmaptest [filename]
+ *	The file (default mmaptest.dat) is created and overwritten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#define PageSize	4096
+#define NumPages	8
+#define FileSize	(NumPages * PageSize - 100)	/* last page is partly past EOF */
+#define AnonPages	256	/* enough that some of it may go to swap */
+
+static char buf[PageSize];
+
+/* what byte i of the file holds to begin with */
+static
+char
+pattern(int i)
+{
+	return 'a' + (i * 7 + i / PageSize) % 26;
+}
+
+static
+void
+makefile(const char *name)
+{
+	int fd, i, j, len;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	for (i=0; i<FileSize; i+=len) {
+		len = FileSize - i < PageSize ? FileSize - i : PageSize;
+		for (j=0; j<len; j++) {
+			buf[j] = pattern(i + j);
+		}
+		if (write(fd, buf, len) != len) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+}
+
+/* byte I of the file, read the ordinary way */
+static
+char
+fileat(int fd, int i)
+{
+	char c;
+
+	if (lseek(fd, i, SEEK_SET) < 0 || read(fd, &c, 1) != 1) {
+		err(1, "read back");
+	}
+	return c;
+}
+
+static
+char *
+map(int len, int prot, int flags, int fd)
+{
+	char *p = mmap(NULL, len, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+/* an anonymous mmap that has to fail with EINVAL */
+static
+void
+badmap(unsigned long addr, unsigned long len, int flags, const char *what)
+{
+	void *p = mmap((void *)addr, len, PROT_READ, flags|MAP_ANON, -1, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "%s: mmap succeeded at %p", what, p);
+	}
+	if (errno != EINVAL) {
+		err(1, "%s: wrong error", what);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *name = argc > 1 ? argv[1] : "mmaptest.dat";
+	char *p;
+	int fd, i, status;
+	pid_t pid;
+
+	makefile(name);
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+
+	/* private: reads the file, writes stay here */
+	p = map(NumPages * PageSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd);
+	for (i=0; i<FileSize; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "private mapping: byte %d is wrong", i);
+		}
+	}
+	for (i=FileSize; i<NumPages * PageSize; i++) {
+		if (p[i] != 0) {
+			errx(1, "private mapping: byte %d past EOF isn't 0", i);
+		}
+	}
+	p[10] = 'X';
+	if (munmap(p, NumPages * PageSize) < 0) {
+		err(1, "munmap");
+	}
+	if (fileat(fd, 10) != pattern(10)) {
+		errx(1, "private mapping changed the file");
+	}
+	printf("private mapping: ok\n");
+
+	/* shared: writes reach the file on fsync and on munmap */
+	p = map(NumPages * PageSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd);
+	p[PageSize + 1] = 'Y';
+	if (fsync(fd) < 0) {
+		err(1, "fsync");
+	}
+	if (fileat(fd, PageSize + 1) != 'Y') {
+		errx(1, "shared mapping: fsync didn't write it back");
+	}
+	p[3 * PageSize + 2] = 'Z';
+	if (munmap(p, NumPages * PageSize) < 0) {
+		err(1, "munmap");
+	}
+	if (fileat(fd, 3 * PageSize + 2) != 'Z') {
+		errx(1, "shared mapping: munmap didn't write it back");
+	}
+	printf("shared mapping: ok\n");
+
+	/* a hole in the middle */
+	p = map(NumPages * PageSize, PROT_READ, MAP_PRIVATE, fd);
+	if (munmap(p + 2 * PageSize, 2 * PageSize) < 0) {
+		err(1, "munmap");
+	}
+	if (p[PageSize] != pattern(PageSize) ||
+	    p[5 * PageSize] != pattern(5 * PageSize)) {
+		errx(1, "partial munmap: the rest of the mapping is wrong");
+	}
+	munmap(p, NumPages * PageSize);
+	printf("partial munmap: ok\n");
+
+	/* advice */
+	p = map(NumPages * PageSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd);
+	if (madvise(p, NumPages * PageSize, MADV_SEQUENTIAL) < 0) {
+		err(1, "madvise MADV_SEQUENTIAL");
+	}
+	for (i=0; i<NumPages; i++) {
+		if (p[i * PageSize] != pattern(i * PageSize)) {
+			errx(1, "sequential mapping: page %d is wrong", i);
+		}
+	}
+	p[20] = 'W';
+	if (madvise(p, PageSize, MADV_DONTNEED) < 0) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	if (p[20] != pattern(20)) {
+		errx(1, "MADV_DONTNEED: the write is still there");
+	}
+	if (madvise(p, NumPages * PageSize, MADV_RANDOM) < 0 ||
+	    madvise(p, NumPages * PageSize, MADV_WILLNEED) < 0) {
+		err(1, "madvise");
+	}
+	munmap(p, NumPages * PageSize);
+	printf("madvise: ok\n");
+	close(fd);
+
+	/* anonymous: zeroed, and shared across fork if asked */
+	p = map(2 * PageSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1);
+	for (i=0; i<2 * PageSize; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous mapping: byte %d isn't 0", i);
+		}
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[PageSize] = 'C';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (p[PageSize] != 'C') {
+		errx(1, "shared anonymous mapping: the child's write isn't here");
+	}
+	/* throwing the pages away would cut this process off from the child's */
+	if (madvise(p, 2 * PageSize, MADV_DONTNEED) == 0) {
+		errx(1, "MADV_DONTNEED on shared anonymous memory succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "MADV_DONTNEED on shared anonymous memory: wrong error");
+	}
+	if (p[PageSize] != 'C') {
+		errx(1, "MADV_DONTNEED on shared anonymous memory lost data");
+	}
+	munmap(p, 2 * PageSize);
+
+	/* the child touches these first; the parent has to see its writes anyway */
+	p = map(AnonPages * PageSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<AnonPages; i++) {
+			p[i * PageSize] = 'a' + i % 26;
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	for (i=0; i<AnonPages; i++) {
+		if (p[i * PageSize] != 'a' + i % 26) {
+			errx(1, "shared anonymous mapping: page %d of the "
+			     "child's writes isn't here", i);
+		}
+	}
+	munmap(p, AnonPages * PageSize);
+	printf("anonymous mapping: ok\n");
+
+	/* MAP_FIXED ranges whose end wraps past the top of memory */
+	badmap(0x90000000UL, 0x80000000UL, MAP_PRIVATE|MAP_FIXED,
+	       "MAP_FIXED across the stack");
+	badmap(0xfffff000UL, PageSize, MAP_PRIVATE|MAP_FIXED,
+	       "MAP_FIXED at the top of memory");
+	badmap(0, PageSize, MAP_PRIVATE|0x4000, "unknown flag");
+	printf("bad mappings: ok\n");
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
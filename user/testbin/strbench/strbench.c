@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * strbench: time the word-at-a-time string routines shared by libc and
+ * the kernel (common/libc/string) against the byte-loop versions they
+ * replaced, across a range of sizes and alignments.
+ *
+ * The new versions are compiled straight from the shared sources under
+ * other names, so this measures the code the kernel and libc actually
+ * use, and it builds for the host (host-strbench) as well as for
+ * OS/161. Each case is also checked against the old version before it
+ * is timed.
+ *
+ * Usage: strbench [scale]
+ * Each measurement moves about scale megabytes; the default is 1,
+ * which is enough on System/161. On the host use something like 100.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#ifdef HOST
+#include "hostcompat.h"
+#endif
+
+void *new_memcpy(void *dst, const void *src, size_t len);
+void *new_memmove(void *dst, const void *src, size_t len);
+void new_bzero(void *block, size_t len);
+size_t new_strlen(const char *str);
+int new_strcmp(const char *a, const char *b);
+
+#undef memcpy
+#undef memmove
+#undef bzero
+#undef strlen
+#undef strcmp
+#define memcpy new_memcpy
+#define memmove new_memmove
+#define bzero new_bzero
+#define strlen new_strlen
+#define strcmp new_strcmp
+
+#include "../../../common/libc/string/memcpy.c"
+#include "../../../common/libc/string/memmove.c"
+#include "../../../common/libc/string/bzero.c"
+#include "../../../common/libc/string/strlen.c"
+#include "../../../common/libc/string/strcmp.c"
+
+#undef memcpy
+#undef memmove
+#undef bzero
+#undef strlen
+#undef strcmp
+
+////////////////////////////////////////////////////////////
+// the previous versions
+
+static
+void *
+old_memcpy(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=0; i<len/sizeof(long); i++) {
+			d[i] = s[i];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=0; i<len; i++) {
+			d[i] = s[i];
+		}
+	}
+	return dst;
+}
+
+static
+void *
+old_memmove(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst < (uintptr_t)src) {
+		return old_memcpy(dst, src, len);
+	}
+
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=len/sizeof(long); i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=len; i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	return dst;
+}
+
+static
+void
+old_bzero(void *vblock, size_t len)
+{
+	char *block = vblock;
+	size_t i;
+
+	if ((uintptr_t)block % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *lb = (long *)block;
+		for (i=0; i<len/sizeof(long); i++) {
+			lb[i] = 0;
+		}
+	}
+	else {
+		for (i=0; i<len; i++) {
+			block[i] = 0;
+		}
+	}
+}
+
+/* the kernel zeroed pages with this */
+static
+void
+old_memset(void *ptr, int ch, size_t len)
+{
+	char *p = ptr;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		p[i] = ch;
+	}
+}
+
+static
+size_t
+old_strlen(const char *str)
+{
+	size_t ret = 0;
+
+	while (str[ret]) {
+		ret++;
+	}
+	return ret;
+}
+
+static
+int
+old_strcmp(const char *a, const char *b)
+{
+	size_t i;
+
+	for (i=0; a[i]!=0 && a[i]==b[i]; i++) {
+		/* nothing */
+	}
+	if ((unsigned char)a[i] > (unsigned char)b[i]) {
+		return 1;
+	}
+	else if (a[i] == b[i]) {
+		return 0;
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////
+// cases
+
+#define BENCHPAGE	4096
+#define MAXSIZE		(4*BENCHPAGE)
+#define MEGABYTE	(1024*1024)
+
+enum op { OP_MEMCPY, OP_MEMMOVE, OP_BZERO, OP_STRLEN, OP_STRCMP, OP_PAGEZERO };
+
+static const char *const opnames[] = {
+	"memcpy", "memmove", "bzero", "strlen", "strcmp", "pagezero",
+};
+
+static const size_t sizes[] = { 8, 64, 512, BENCHPAGE, MAXSIZE };
+static const unsigned aligns[][2] = { {0,0}, {1,1}, {0,1}, {3,2} };
+
+#define NSIZES	(sizeof(sizes)/sizeof(sizes[0]))
+#define NALIGNS	(sizeof(aligns)/sizeof(aligns[0]))
+
+static char rawa[MAXSIZE + 2*BENCHPAGE];
+static char rawb[MAXSIZE + 2*BENCHPAGE];
+static char *bufa, *bufb;	/* page-aligned within rawa, rawb */
+static volatile size_t sink;	/* keeps results from being optimized out */
+static unsigned scale = 1;
+
+/*
+ * Lay down a string of LEN nonzero bytes at P, terminated.
+ */
+static
+void
+fillstring(char *p, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		p[i] = 'a' + i % 26;
+	}
+	p[len] = 0;
+}
+
+/*
+ * Run one call of op (old or new) on dst/src with length len.
+ */
+static
+void
+runop(enum op op, int new, char *dst, char *src, size_t len)
+{
+	switch (op) {
+	    case OP_MEMCPY:
+		if (new) new_memcpy(dst, src, len);
+		else old_memcpy(dst, src, len);
+		break;
+	    case OP_MEMMOVE:
+		if (new) new_memmove(dst, src, len);
+		else old_memmove(dst, src, len);
+		break;
+	    case OP_BZERO:
+		if (new) new_bzero(dst, len);
+		else old_bzero(dst, len);
+		break;
+	    case OP_STRLEN:
+		sink += new ? new_strlen(src) : old_strlen(src);
+		break;
+	    case OP_STRCMP:
+		sink += new ? new_strcmp(dst, src) : old_strcmp(dst, src);
+		break;
+	    case OP_PAGEZERO:
+		if (new) new_bzero(dst, len);
+		else old_memset(dst, 0, len);
+		break;
+	}
+}
+
+/*
+ * Set up the buffers for op, run it once with the old version and
+ * once with the new, and make sure both did the same thing.
+ */
+static
+void
+check(enum op op, size_t len, char *dst, char *src)
+{
+	static char expect[MAXSIZE];
+	size_t r1, r2;
+
+	switch (op) {
+	    case OP_MEMCPY:
+	    case OP_MEMMOVE:
+		fillstring(src, len);
+		old_memset(dst, 0x55, len);
+		runop(op, 0, dst, src, len);
+		old_memcpy(expect, dst, len);
+		fillstring(src, len);
+		old_memset(dst, 0x55, len);
+		runop(op, 1, dst, src, len);
+		if (memcmp(expect, dst, len)) {
+			errx(1, "%s: wrong result, size %lu",
+			     opnames[op], (unsigned long) len);
+		}
+		break;
+	    case OP_BZERO:
+	    case OP_PAGEZERO:
+		old_memset(dst - 1, 0x55, len + 2);
+		runop(op, 1, dst, src, len);
+		for (r1=0; r1<len; r1++) {
+			if (dst[r1] != 0) {
+				errx(1, "%s: byte %lu not zeroed", opnames[op],
+				     (unsigned long) r1);
+			}
+		}
+		if (dst[-1] != 0x55 || dst[len] != 0x55) {
+			errx(1, "%s: wrote outside the block", opnames[op]);
+		}
+		break;
+	    case OP_STRLEN:
+		fillstring(src, len);
+		if (new_strlen(src) != len) {
+			errx(1, "strlen: got %lu, expected %lu",
+			     (unsigned long) new_strlen(src),
+			     (unsigned long) len);
+		}
+		break;
+	    case OP_STRCMP:
+		fillstring(src, len);
+		fillstring(dst, len);
+		dst[len-1]++;
+		r1 = old_strcmp(dst, src);
+		r2 = new_strcmp(dst, src);
+		if (r1 != r2) {
+			errx(1, "strcmp: got %d, expected %d", (int)r2,
+			     (int)r1);
+		}
+		/* time the slowest case: equal all the way down */
+		dst[len-1]--;
+		break;
+	}
+}
+
+/*
+ * Time REPS calls; returns nanoseconds.
+ */
+static
+uint64_t
+timeop(enum op op, int new, char *dst, char *src, size_t len,
+       unsigned reps)
+{
+	time_t s1, s2;
+	unsigned long ns1, ns2;
+	unsigned i;
+
+	__time(&s1, &ns1);
+	for (i=0; i<reps; i++) {
+		runop(op, new, dst, src, len);
+	}
+	__time(&s2, &ns2);
+	return (uint64_t)(s2 - s1) * 1000000000ULL + ns2 - ns1;
+}
+
+static
+void
+bench(enum op op, size_t len, unsigned dalign, unsigned salign)
+{
+	char *dst = bufa + dalign;
+	char *src = bufb + salign;
+	unsigned reps;
+	uint64_t told, tnew;
+
+	if (op == OP_MEMMOVE) {
+		/* overlapping, dst just above src: the backwards case */
+		dst = bufb + 2*sizeof(long) + dalign;
+	}
+
+	check(op, len, dst, src);
+
+	reps = (scale * MEGABYTE) / len;
+	if (reps == 0) {
+		reps = 1;
+	}
+	told = timeop(op, 0, dst, src, len, reps);
+	tnew = timeop(op, 1, dst, src, len, reps);
+	if (tnew == 0) {
+		tnew = 1;
+	}
+
+	printf("%-8s %6lu  %u/%u  old %9lu ns  new %9lu ns  x%lu.%02lu\n",
+	       opnames[op], (unsigned long) len, dalign, salign,
+	       (unsigned long) (told / reps), (unsigned long) (tnew / reps),
+	       (unsigned long) (told / tnew),
+	       (unsigned long) (told * 100 / tnew % 100));
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned op, i, j;
+
+#ifdef HOST
+	hostcompat_init(argc, argv);
+#endif
+
+	if (argc > 2) {
+		errx(1, "Usage: strbench [scale]");
+	}
+	if (argc == 2) {
+		scale = atoi(argv[1]);
+		if (scale == 0) {
+			errx(1, "Usage: strbench [scale]");
+		}
+	}
+
+	bufa = (char *)(((uintptr_t)rawa + BENCHPAGE) & ~(uintptr_t)(BENCHPAGE-1));
+	bufb = (char *)(((uintptr_t)rawb + BENCHPAGE) & ~(uintptr_t)(BENCHPAGE-1));
+
+	printf("op         size  align (dst/src)  time per call  speedup\n");
+	for (op=OP_MEMCPY; op<=OP_STRCMP; op++) {
+		for (i=0; i<NSIZES; i++) {
+			for (j=0; j<NALIGNS; j++) {
+				bench(op, sizes[i], aligns[j][0], aligns[j][1]);
+			}
+		}
+	}
+
+	/* whole pages, the way the VM system zeroes and copies them */
+	bench(OP_PAGEZERO, BENCHPAGE, 0, 0);
+	bench(OP_MEMCPY, BENCHPAGE, 0, 0);
+
+	printf("strbench: passed (sink %lu)\n", (unsigned long) sink);
+	return 0;
+}
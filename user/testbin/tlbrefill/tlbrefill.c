@@ -0,0 +1,76 @@
+/*
+ * tlbrefill.c
+ *
+ *	Measures what a TLB miss on a resident page costs. Touches one
+ *	word per page, round and round, first over few enough pages to
+ *	stay in the TLB and then over many more pages than the TLB
+ *	holds, so every access of the second run misses. The difference
+ *	per access is the refill latency.
+ *
+ *	All the pages are touched once before timing starts, so nothing
+ *	here should need vm_fault once memory is big enough to hold
+ *	them; compare the kernel's "tlb:" stats (vm in the menu) before
+ *	and after a run to check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PageSize	4096
+#define SmallPages	32	/* fits in the TLB with room to spare */
+#define BigPages	256	/* 4x the TLB: every access misses */
+#define Accesses	(1024*1024)
+
+static char pages[BigPages][PageSize];
+
+/* nanoseconds to do Accesses touches round-robin over npages pages */
+static
+unsigned long
+run(int npages)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	volatile char *p;
+	int i, page;
+
+	page = 0;
+	__time(&s0, &ns0);
+	for (i=0; i<Accesses; i++) {
+		p = pages[page];
+		(*p)++;
+		if (++page == npages) {
+			page = 0;
+		}
+	}
+	__time(&s1, &ns1);
+
+	return (s1 - s0) * 1000000000UL + ns1 - ns0;
+}
+
+int
+main(void)
+{
+	unsigned long small, big;
+	int i;
+
+	/* fault everything in first */
+	for (i=0; i<BigPages; i++) {
+		pages[i][0] = 0;
+	}
+
+	small = run(SmallPages);
+	big = run(BigPages);
+
+	printf("%d accesses over %d pages: %lu ns (%lu ns each)\n",
+	       Accesses, SmallPages, small, small / Accesses);
+	printf("%d accesses over %d pages: %lu ns (%lu ns each)\n",
+	       Accesses, BigPages, big, big / Accesses);
+	if (big > small) {
+		printf("TLB refill: about %lu ns\n", (big - small) / Accesses);
+	}
+	else {
+		printf("TLB refill: too cheap to measure\n");
+	}
+	return 0;
+}